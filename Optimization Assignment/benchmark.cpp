@@ -0,0 +1,67 @@
+// Headless benchmark for the tank battle
+// usage: <exe> -bench <ticks> [-threads <n>] [-state] [-norender] [-drawevery <n>] [-replay <file>]
+//        [-trace <file> <first tick> <ticks>]
+//        [-p1 <n>] [-p2 <n>] [-bullets <n>] [-world <w> <h>] [-spacing <d>] [-smoke <n>] [-config <file>]
+
+#include "template.h"
+
+// Benchmark - initialise the game (or load save.state with -state), optionally
+// replaying recorded input, run a fixed number of ticks without a window and report throughput,
+// per-phase times and a checksum of the final simulation state. The checksum
+// only changes when the simulation does, so it doubles as a regression check.
+int Benchmark( int argc, char** argv )
+{
+	int ticks = 1000, threads = 0, drawEvery = 1;
+	bool loadState = false, render = true;
+	const char* replay = 0, *traceFile = 0;
+	int traceFirst = 0, traceTicks = 0;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if (!strcmp( argv[i], "-bench" ) && (i + 1 < argc)) ticks = atoi( argv[++i] );
+		else if (!strcmp( argv[i], "-threads" ) && (i + 1 < argc)) threads = atoi( argv[++i] );
+		else if (!strcmp( argv[i], "-state" )) loadState = true;
+		else if (!strcmp( argv[i], "-norender" )) render = false;
+		else if (!strcmp( argv[i], "-drawevery" ) && (i + 1 < argc)) drawEvery = max( 1, atoi( argv[++i] ) );
+		else if (!strcmp( argv[i], "-replay" ) && (i + 1 < argc)) replay = argv[++i];
+		else if (!strcmp( argv[i], "-trace" ) && (i + 3 < argc))
+			traceFile = argv[++i], traceFirst = atoi( argv[++i] ), traceTicks = atoi( argv[++i] );
+	}
+	if (threads > 0) JobManager::CreateJobManager( min( threads, MAXJOBTHREADS ) );
+	Surface* surface = new Surface( SCRWIDTH, SCRHEIGHT );
+	surface->Clear( 0 );
+	surface->InitCharset();
+	Game* game = new Game();
+	game->SetTarget( surface );
+	game->SetRender( render );
+	game->m_Config.Parse( argc, argv );
+	if (replay && !game->m_Input.Replay( replay )) printf( "could not replay %s\n", replay );
+	Timer timer;
+	game->Init( loadState );
+	const float initTime = timer.elapsed();
+	timer.reset();
+	for ( int i = 0; i < ticks; i++ )
+	{
+		if (traceFile && (i == traceFirst)) Profiler::StartTrace( traceFile, traceTicks );
+		// with -drawevery only every n-th tick and the last one are drawn, like a fast-forwarding game
+		game->SetRender( render && (((i + 1) % drawEvery == 0) || (i == ticks - 1)) );
+		game->Tick( 0 );
+		if (Profiler::enabled) Profiler::EndFrame(); // a benchmark frame is one tick
+	}
+	const float runTime = timer.elapsed();
+	printf( "ticks:    %i (%s, %i threads, %s)\n", ticks, loadState ? "save.state" : "new battle", JobManager::GetJobManager()->GetNumThreads(), render ? "rendering" : "no rendering" );
+	printf( "armies:   %u blue, %u red\n", game->m_Config.p1, game->m_Config.p2 );
+	printf( "init:     %.1f ms\n", initTime );
+	printf( "run:      %.1f ms, %.1f ticks/s\n", runTime, ticks * 1000.0f / runTime );
+	printf( "tanks:    %.3f ms/tick\n", game->m_PhaseTime[Game::PHASE_TANKS] / ticks );
+	printf( "bullets:  %.3f ms/tick\n", game->m_PhaseTime[Game::PHASE_BULLETS] / ticks );
+	printf( "draw:     %.3f ms/tick\n", game->m_PhaseTime[Game::PHASE_DRAW] / ticks );
+	printf( "checksum: %016llx\n", game->Checksum() );
+	if (render)
+	{
+		// FNV-1a over the last frame, to catch drawing changes as well
+		unsigned long long h = 0xcbf29ce484222325ULL;
+		for ( int i = 0; i < SCRWIDTH * SCRHEIGHT; i++ ) h = (h ^ surface->GetBuffer()[i]) * 0x100000001b3ULL;
+		printf( "frame:    %016llx\n", h );
+	}
+	return 0;
+}
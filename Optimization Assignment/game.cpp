@@ -1,9 +1,6 @@
 #include "template.h"
-#include <iostream>
-#include <fstream>
-#include <string>
 
-#define DEV
+// #define SORTEDGRID	// rebuild the grids every frame with a counting sort instead of add/remove
 
 // global data (source scope)
 static Game* game;
@@ -14,187 +11,660 @@ static float peaky[16] = { 199, 223, 83, 374,  694, 639, 469, 368, 545, 145,  63
 static float peakh[16] = { 200, 150, 160, 255, 200, 255, 200, 300, 120, 100,  80, 80,  80, 160, 160, 160 };
 
 // player, bullet and smoke data
-static int aliveP1 = MAXP1;
-static int aliveP2 = MAXP2;
-static Bullet bullet[MAXBULLET];
-static GridCell tankGrid[GRIDY][GRIDX];
-static GridCell teamGrid[2][GRIDY][GRIDX];
-static float sinTable[720];
-static float cosTable[720];
-static float maxr;
+static int aliveP1 = 0;
+static int aliveP2 = 0;
+static BulletPool bullets;
+
+// grid geometry, set up by InitGrids from the configured world extents: gridW
+// x gridH cells, cell (0, 0) starting at world position (-gridOriginX,
+// -gridOriginY). The cells are stored with a guard ring of always empty cells
+// around them, so the neighbours of any cell on the grid can be read without
+// clamping; gridCells counts the stored cells, ring included.
+static int gridW = 0, gridH = 0, gridOriginX = 0, gridOriginY = 0;
+static unsigned int gridCells = 0;
+static inline unsigned int Cell( int x, int y ) { return (y + 1) * (gridW + 2) + x + 1; }
+static inline bool OnGrid( int x, int y ) { return ((unsigned int)x < (unsigned int)gridW) && ((unsigned int)y < (unsigned int)gridH); }
+inline int TankArmy::gridX( unsigned int i ) { return ((int)pos[i].x + gridOriginX) >> 4; }
+inline int TankArmy::gridY( unsigned int i ) { return ((int)pos[i].y + gridOriginY) >> 4; }
+static GridCell* tankGrid = 0;
+static GridCell* teamGrid[2] = { 0, 0 };
+GridBucket* GridCell::bucket = 0;
+unsigned int GridCell::bucketCapacity = 0, GridCell::freeBucket = 0;
+#ifdef SORTEDGRID
+// sorted grids: tankGrid, teamGrid[0] and teamGrid[1] are stored back to back
+// in one flat index array, rebuilt by RebuildGrids; grid g, cell c spans
+// sortedIndex[cellStart[g * gridCells + c]] up to cellStart[g * gridCells + c + 1]
+static unsigned int* sortedIndex = 0;
+static unsigned int sortedCapacity = 0;
+static unsigned int* cellStart = 0;
+static inline GridRun TankCell( int x, int y )
+{
+	const unsigned int c = Cell( x, y );
+	return GridRun( sortedIndex + cellStart[c], cellStart[c + 1] - cellStart[c] );
+}
+static inline GridRun TeamCell( int team, int x, int y )
+{
+	const unsigned int c = (1 + team) * gridCells + Cell( x, y );
+	return GridRun( sortedIndex + cellStart[c], cellStart[c + 1] - cellStart[c] );
+}
+#else
+static inline GridRun TankCell( int x, int y ) { return GridRun( tankGrid[Cell( x, y )] ); }
+static inline GridRun TeamCell( int team, int x, int y ) { return GridRun( teamGrid[team][Cell( x, y )] ); }
+#endif
 static unsigned char mountainCircle[16][64];
 
-// smoke particle effect tick function
-void Smoke::Tick()
+// influence circle pixels: deduplicated midpoint circle offsets per radius,
+// ring r occupies ringOffset[ringStart[r]] up to ringOffset[ringStart[r + 1]]
+struct RingOffset { short x, y; };
+static RingOffset ringOffset[64 * 8 * 64];
+static int ringStart[65];
+
+// mountain repulsion baked into a field of samples every FIELDCELL units,
+// covering the peaks' range of influence; sampled bilinearly by the tanks
+#define FIELDCELL	4
+#define FIELDX0		-128
+#define FIELDY0		-128
+#define FIELDW		(1280 / FIELDCELL + 1)
+#define FIELDH		(1024 / FIELDCELL + 1)
+#define PEAKRANGE	86.7f	// sd < 1500 <=> distance < sqrt( 1500 / 0.2 )
+struct FieldSample { float2 force; unsigned int peaks, dummy; };
+static FieldSample* forceField = 0;
+
+// parallel tank update: each job ticks a range of tanks against the grids as
+// they were at the start of the frame; Game::UpdateTanks merges the results
+#define TANKSPERJOB	256
+class TankJob : public Job
 {
-	unsigned int p = frame >> 3;
-
-	if (frame < 64) 
-		if (!(frame++ & 7))
+public:
+	void Main()
+	{
+		PROFILE( ZONE_TANKJOB );
+		memset( circle, 0, sizeof( circle ) );
+		for ( unsigned int i = first; i < last; i++ ) game->m_Army.Tick( i, circle );
+	}
+	unsigned int first, last;
+	unsigned char circle[16][64];
+};
+static TankJob tankJob[MAXJOBS];
+
+#ifdef SORTEDGRID
+// counting sort of the tanks into the grid cells: pass 0 counts the tanks per
+// cell, pass 1 scatters them to the offsets RebuildGrids computed from those
+// counts. Job j writes after jobs 0..j-1 in every cell, keeping each cell in
+// tank order regardless of the thread count.
+class GridSortJob : public Job
+{
+public:
+	void Main()
+	{
+		const TankArmy& army = game->m_Army;
+		if (pass == 0) memset( offset, 0, 3 * gridCells * sizeof( unsigned int ) );
+		for ( unsigned int i = first; i < last; i++ ) if (army.inGrid[i])
 		{
-			puff[p].x = xpos;
-			puff[p].y = ypos << 8; 
-			puff[p].vy = -450;
-			puff[p].life = 63;
+			const unsigned int c = Cell( ((int)army.pos[i].x + gridOriginX) >> 4, ((int)army.pos[i].y + gridOriginY) >> 4 );
+			const unsigned int t = (2 - (army.flags[i] >> 2)) * gridCells + c; // teamGrid[1 ^ (flags >> 2)]
+			const bool alive = (army.flags[i] & TankArmy::ACTIVE) != 0;
+			if (pass == 0)
+			{
+				offset[c]++;
+				if (alive) offset[t]++;
+			}
+			else
+			{
+				sortedIndex[offset[c]++] = i;
+				if (alive) sortedIndex[offset[t]++] = i;
+			}
 		}
+	}
+	unsigned int first, last, pass;
+	unsigned int* offset;
+};
+static GridSortJob gridJob[MAXJOBTHREADS];
 
-	for ( unsigned int i = 0; i < p; i++ ) 
-		if ((frame < 64) || (i & 1))
+// RebuildGrids - sort all gridded tanks into the flat cell array
+static void RebuildGrids()
+{
+	const TankArmy& army = game->m_Army;
+	if (sortedCapacity < 2 * army.count)
+	{
+		FREE64( sortedIndex );
+		sortedCapacity = 2 * army.count;
+		sortedIndex = (unsigned int*)MALLOC64( sortedCapacity * sizeof( unsigned int ) );
+	}
+	JobManager* jm = JobManager::GetJobManager();
+	const unsigned int jobs = jm->GetNumThreads(), perJob = (army.count + jobs - 1) / jobs;
+	for ( unsigned int pass = 0; pass < 2; pass++ )
+	{
+		for ( unsigned int j = 0; j < jobs; j++ )
 		{
-			puff[i].x++;
-			puff[i].y += puff[i].vy;
-			puff[i].vy += 3;
-
-			int frame = (puff[i].life > 13) ? (9 - (puff[i].life - 14) / 5) : (puff[i].life / 2);
-
-			game->m_Smoke->SetFrame(frame);
-			game->m_Smoke->Draw(puff[i].x - 12,(puff[i].y >> 8) - 12, game->m_Surface);
-
-			if (!--puff[i].life)
+			if (!gridJob[j].offset) gridJob[j].offset = (unsigned int*)MALLOC64( 3 * gridCells * sizeof( unsigned int ) );
+			gridJob[j].first = min( j * perJob, army.count );
+			gridJob[j].last = min( (j + 1) * perJob, army.count );
+			gridJob[j].pass = pass;
+			jm->AddJob2( &gridJob[j] );
+		}
+		jm->RunJobs();
+		if (pass == 1) break;
+		// exclusive prefix sum over cells, then over jobs within each cell
+		unsigned int n = 0;
+		for ( unsigned int c = 0; c < 3 * gridCells; c++ )
+		{
+			cellStart[c] = n;
+			for ( unsigned int j = 0; j < jobs; j++ )
 			{
-				puff[i].x = xpos;
-				puff[i].y = ypos << 8;
-				puff[i].vy = -450;
-				puff[i].life = 63;
+				const unsigned int count = gridJob[j].offset[c];
+				gridJob[j].offset[c] = n;
+				n += count;
 			}
 		}
+		cellStart[3 * gridCells] = n;
+	}
 }
+#endif
 
-// bullet Tick function
-void Bullet::Tick()
+// SmokeSystem::Resize - set the number of emitters, growing the arrays
+// (to at least twice their size) when needed
+void SmokeSystem::Resize( unsigned int a_Count )
 {
-	if (!(flags & Bullet::ACTIVE)) return;
+	if (a_Count > capacity)
+	{
+		const unsigned int newCapacity = max( a_Count, max( 2 * capacity, 64u ) );
+		int** emitter[3] = { &x, &y, &age }, **puff[4] = { &px, &py, &vy, &life };
+		for ( int a = 0; a < 3; a++ )
+		{
+			int* grown = (int*)MALLOC64( newCapacity * sizeof( int ) );
+			if (count) memcpy( grown, *emitter[a], count * sizeof( int ) );
+			FREE64( *emitter[a] ), *emitter[a] = grown;
+		}
+		for ( int a = 0; a < 4; a++ )
+		{
+			int* grown = (int*)MALLOC64( newCapacity * PUFFS * sizeof( int ) );
+			if (count) memcpy( grown, *puff[a], count * PUFFS * sizeof( int ) );
+			FREE64( *puff[a] ), *puff[a] = grown;
+		}
+		unsigned char* grown = (unsigned char*)MALLOC64( newCapacity );
+		if (count) memcpy( grown, moved, count );
+		FREE64( moved ), moved = grown;
+		capacity = newCapacity;
+	}
+	count = a_Count;
+}
 
-	float2 prevpos = pos;
-	pos += speed * 1.5f;
-	prevpos -= pos - prevpos;
-	game->m_Surface->AddLine( prevpos.x, prevpos.y, pos.x, pos.y, 0x555555 );
+SmokeSystem::~SmokeSystem()
+{
+	FREE64( x ); FREE64( y ); FREE64( age ); FREE64( moved );
+	FREE64( px ); FREE64( py ); FREE64( vy ); FREE64( life );
+}
 
-	if ((pos.x < 0) || (pos.x > (SCRWIDTH - 1)) || (pos.y < 0) || (pos.y > (SCRHEIGHT - 1))) 
-		flags = 0; // off-screen
-	
-	int grid_x = gridX();
-	int grid_y = gridY();
+// SmokeSystem::Spawn - add an emitter at (a_X, a_Y); its first puff starts
+// on its first Tick
+unsigned int SmokeSystem::Spawn( int a_X, int a_Y )
+{
+	const unsigned int e = count;
+	Resize( count + 1 );
+	x[e] = a_X, y[e] = a_Y, age[e] = 0, moved[e] = 0;
+	return e;
+}
 
-	for (int i = -1; i < 2; i++)
-		for (int j = -1; j < 2; j++)
+// SmokeSystem::Tick - every emitter starts a puff each 8 ticks until all
+// PUFFS are out, after which only the odd puffs keep rising. A puff's life
+// is the value it was last drawn with: it counts down at the start of its
+// next move and the puff restarts at the emitter when it reaches 0.
+void SmokeSystem::Tick()
+{
+	for ( unsigned int e = 0; e < count; e++ )
+	{
+		const int p = age[e] >> 3;
+		int* const ppx = px + e * PUFFS, *const ppy = py + e * PUFFS, *const pvy = vy + e * PUFFS, *const plife = life + e * PUFFS;
+		if (age[e] < 64) if (!(age[e]++ & 7))
+			ppx[p] = x[e], ppy[p] = y[e] << 8, pvy[p] = -450, plife[p] = 64;
+		const bool all = age[e] < 64;
+		unsigned int mask = 0;
+		for ( int i = 0; i < p; i++ ) if (all || (i & 1))
 		{
-			int curX = (grid_x + j) & GRIDXMASK;
-			int curY = (grid_y + i) & GRIDYMASK;
-
-			int posX = (curX + 512) * 16;
-			
-			GridCell gc = teamGrid[flags >> 2][curY][curX];
-			int count = teamGrid[flags >> 2][curY][curX].count;
-			if (count > 0)
-			{
-				int a = 1;
-				a *= count;
-			}
-			int alpha = flags;
-			for (int k = 0; k < count; k++)
-			{
-				Tank* t = gc.getTank(k);
+			if (!--plife[i]) ppx[i] = x[e], ppy[i] = y[e] << 8, pvy[i] = -450, plife[i] = 63;
+			ppx[i]++;
+			ppy[i] += pvy[i];
+			pvy[i] += 3;
+			mask |= 1 << i;
+		}
+		moved[e] = (unsigned char)mask;
+	}
+}
+
+// SmokeFrame - animation frame of a puff: grows in over the first 50 ticks
+// of its life, fades out over the last 13
+static inline int SmokeFrame( int a_Life ) { return (a_Life > 13) ? (9 - (a_Life - 14) / 5) : (a_Life / 2); }
 
-				if (!((pos.x >(t->pos.x - 2)) && (pos.y >(t->pos.y - 2)) && (pos.x < (t->pos.x + 2)) && (pos.y < (t->pos.y + 2))))
-					continue;
+// SmokeSystem::Draw - add the puffs that moved in the last Tick and are on
+// screen to a_Batch, sorted by animation frame. Smoke adds its colour, so the
+// order does not change the image.
+void SmokeSystem::Draw( SpriteBatch& a_Batch, Sprite* a_Sprite, unsigned int a_Budget )
+{
+	if (!a_Budget) return;
+	const int w = a_Sprite->GetWidth(), h = a_Sprite->GetHeight();
+	visible.clear();
+	for ( unsigned int e = 0; e < count; e++ ) for ( unsigned int mask = moved[e], i = 0; mask; mask >>= 1, i++ ) if (mask & 1)
+	{
+		const unsigned int k = e * PUFFS + i;
+		const int sx = px[k] - 12, sy = (py[k] >> 8) - 12;
+		if ((sx < SCRWIDTH) && (sy < SCRHEIGHT) && (sx + w > 0) && (sy + h > 0)) visible.push_back( k );
+	}
+	// over budget: keep every stride-th emitter, the same ones every frame
+	const unsigned int stride = ((unsigned int)visible.size() + a_Budget - 1) / a_Budget;
+	unsigned int start[FRAMES + 1] = { 0 }, n = 0;
+	for ( size_t v = 0; v < visible.size(); v++ ) if (((visible[v] / PUFFS) % stride) == 0)
+		start[SmokeFrame( life[visible[v]] ) + 1]++, visible[n++] = visible[v];
+	for ( int f = 0; f < FRAMES; f++ ) start[f + 1] += start[f];
+	order.resize( n );
+	for ( unsigned int v = 0; v < n; v++ ) order[start[SmokeFrame( life[visible[v]] )]++] = visible[v];
+	for ( unsigned int v = 0; v < n; v++ )
+	{
+		const unsigned int k = order[v];
+		a_Batch.Add( a_Sprite, SmokeFrame( life[k] ), px[k] - 12, (py[k] >> 8) - 12 );
+	}
+}
 
-				// update counters
-				if (t->flags & Tank::P1)
-					aliveP1--;
-				else
-					aliveP2--;
+// GridCell::slot - address of the i-th index in the cell or its bucket chain
+unsigned int* GridCell::slot( unsigned int i )
+{
+	if (i < SLOTS) return &index[i];
+	GridBucket* b = &bucket[next - 1];
+	for ( i -= SLOTS; i >= GridBucket::SLOTS; i -= GridBucket::SLOTS ) b = &bucket[b->next - 1];
+	return &b->index[i];
+}
 
-				t->flags &= Tank::P1 | Tank::P2;	// kill tank
-				teamGrid[1 ^ (t->flags >> 2)][t->gridY()][t->gridX()].remove(t);
-				flags = 0;						// destroy bullet
-				break;
-			}
+// GridCell::add - append a tank, linking in a new bucket when the last one is full
+void GridCell::add( unsigned int newindex )
+{
+	if ((count >= SLOTS) && (((count - SLOTS) % GridBucket::SLOTS) == 0))
+	{
+		if (!freeBucket)
+		{
+			// grow the bucket pool; free buckets are chained through 'next'
+			const unsigned int newCapacity = bucketCapacity ? bucketCapacity * 2 : 256;
+			GridBucket* newBucket = (GridBucket*)MALLOC64( newCapacity * sizeof( GridBucket ) );
+			if (bucket) memcpy( newBucket, bucket, bucketCapacity * sizeof( GridBucket ) );
+			for ( unsigned int i = bucketCapacity; i < newCapacity; i++ ) newBucket[i].next = (i + 1 < newCapacity) ? i + 2 : 0;
+			freeBucket = bucketCapacity + 1;
+			FREE64( bucket );
+			bucket = newBucket;
+			bucketCapacity = newCapacity;
 		}
-		
-	/*
-	unsigned int start = 0, end = MAXP1;
+		const unsigned int b = freeBucket;
+		freeBucket = bucket[b - 1].next;
+		bucket[b - 1].next = 0;
+		if (count == SLOTS) next = b; else
+		{
+			GridBucket* last = &bucket[next - 1];
+			while (last->next) last = &bucket[last->next - 1];
+			last->next = b;
+		}
+	}
+	*slot( count++ ) = newindex;
+}
 
-	if (flags & P1)
+// GridCell::remove - replace the tank by the last one, releasing an emptied bucket
+void GridCell::remove( unsigned int oldindex )
+{
+	unsigned int i = 0;
+	while (*slot( i ) != oldindex)
+		i++;
+	*slot( i ) = *slot( --count );
+	if ((count >= SLOTS) && (((count - SLOTS) % GridBucket::SLOTS) == 0))
 	{
-	start = MAXP1;
-	end = MAXP1 + MAXP2;
+		unsigned int* link = &next;
+		while (bucket[*link - 1].next) link = &bucket[*link - 1].next;
+		bucket[*link - 1].next = freeBucket;
+		freeBucket = *link;
+		*link = 0;
 	}
+}
 
-	for ( unsigned int i = start; i < end; i++ ) // check all opponents
+// ClearGrids - empty all cells and return every overflow bucket to the free chain
+static void ClearGrids()
+{
+	for ( unsigned int c = 0; c < gridCells; c++ )
 	{
-		Tank* t = game->m_Tank[i];
+		tankGrid[c].count = tankGrid[c].next = 0;
+		teamGrid[0][c].count = teamGrid[0][c].next = 0;
+		teamGrid[1][c].count = teamGrid[1][c].next = 0;
+	}
+	for ( unsigned int i = 0; i < GridCell::bucketCapacity; i++ ) GridCell::bucket[i].next = (i + 1 < GridCell::bucketCapacity) ? i + 2 : 0;
+	GridCell::freeBucket = GridCell::bucketCapacity ? 1 : 0;
+}
 
-		if (!((t->flags & Tank::ACTIVE) && (pos.x > (t->pos.x - 2)) && (pos.y > (t->pos.y - 2)) && (pos.x < (t->pos.x + 2)) && (pos.y < (t->pos.y + 2)))) 
-			continue;
+// InitGrids - allocate the three grids for a world of a_W x a_H units, but at
+// least the screen, centered on the screen
+static void InitGrids( int a_W, int a_H )
+{
+	gridW = (max( a_W, SCRWIDTH ) + GRIDSIZE - 1) / GRIDSIZE;
+	gridH = (max( a_H, SCRHEIGHT ) + GRIDSIZE - 1) / GRIDSIZE;
+	gridOriginX = (gridW * GRIDSIZE - SCRWIDTH) / 2;
+	gridOriginY = (gridH * GRIDSIZE - SCRHEIGHT) / 2;
+	gridCells = (gridW + 2) * (gridH + 2);
+	FREE64( tankGrid ); FREE64( teamGrid[0] ); FREE64( teamGrid[1] );
+	tankGrid = (GridCell*)MALLOC64( gridCells * sizeof( GridCell ) );
+	teamGrid[0] = (GridCell*)MALLOC64( gridCells * sizeof( GridCell ) );
+	teamGrid[1] = (GridCell*)MALLOC64( gridCells * sizeof( GridCell ) );
+	ClearGrids();
+#ifdef SORTEDGRID
+	FREE64( cellStart );
+	cellStart = (unsigned int*)MALLOC64( (3 * gridCells + 1) * sizeof( unsigned int ) );
+	memset( cellStart, 0, (3 * gridCells + 1) * sizeof( unsigned int ) );
+	for ( int j = 0; j < MAXJOBTHREADS; j++ ) FREE64( gridJob[j].offset ), gridJob[j].offset = 0;
+#endif
+}
 
-		// update counters
-		if (t->flags & Tank::P1) 
-			aliveP1--; 
-		else 
-			aliveP2--; 
+// BulletPool::Init - (re)allocate a_Capacity slots, rounded up to a multiple of 4
+void BulletPool::Init( unsigned int a_Capacity )
+{
+	FREE64( px ); FREE64( py ); FREE64( vx ); FREE64( vy ); FREE64( flags );
+	capacity = (a_Capacity + 3) & ~3;
+	px = (float*)MALLOC64( capacity * sizeof( float ) );
+	py = (float*)MALLOC64( capacity * sizeof( float ) );
+	vx = (float*)MALLOC64( capacity * sizeof( float ) );
+	vy = (float*)MALLOC64( capacity * sizeof( float ) );
+	flags = (int*)MALLOC64( capacity * sizeof( int ) );
+	memset( px, 0, capacity * sizeof( float ) ); memset( py, 0, capacity * sizeof( float ) );
+	memset( vx, 0, capacity * sizeof( float ) ); memset( vy, 0, capacity * sizeof( float ) );
+	memset( flags, 0, capacity * sizeof( int ) );
+	count = 0;
+}
+
+BulletPool::~BulletPool()
+{
+	FREE64( px ); FREE64( py ); FREE64( vx ); FREE64( vy ); FREE64( flags );
+}
 
-		t->flags &= Tank::P1|Tank::P2;	// kill tank
-		teamGrid[1 ^ (t->flags >> 2)][t->gridY()][t->gridX()].remove(t);
-		flags = 0;						// destroy bullet
-		break;
+// BulletPool::Spawn - append a bullet, doubling the pool if it is full
+void BulletPool::Spawn( unsigned int a_Party, const float2& a_Pos, const float2& a_Speed )
+{
+	if (count == capacity)
+	{
+		float* opx = px, *opy = py, *ovx = vx, *ovy = vy;
+		int* oflags = flags;
+		const unsigned int oldCount = count;
+		px = py = vx = vy = 0, flags = 0;
+		Init( capacity ? capacity * 2 : 64 );
+		memcpy( px, opx, oldCount * sizeof( float ) ); memcpy( py, opy, oldCount * sizeof( float ) );
+		memcpy( vx, ovx, oldCount * sizeof( float ) ); memcpy( vy, ovy, oldCount * sizeof( float ) );
+		memcpy( flags, oflags, oldCount * sizeof( int ) );
+		count = oldCount;
+		FREE64( opx ); FREE64( opy ); FREE64( ovx ); FREE64( ovy ); FREE64( oflags );
 	}
-	*/
+	px[count] = a_Pos.x, py[count] = a_Pos.y;
+	vx[count] = a_Speed.x, vy[count] = a_Speed.y;
+	flags[count++] = ACTIVE + a_Party; // set owner, set active
+}
+
+// BulletPool::Sweep - first enemy tank whose box (-2..2 around its position) is
+// crossed by the segment a_From..a_To, or -1. A separating axis test: the box
+// must overlap the segment's bounds and straddle its line. Candidates from the
+// cells under the segment are tested four at a time, cells are read in place.
+int BulletPool::Sweep( unsigned int i, float2 a_From, float2 a_To )
+{
+	const float2 d = a_To - a_From;
+	const float x0 = min( a_From.x, a_To.x ), x1 = max( a_From.x, a_To.x );
+	const float y0 = min( a_From.y, a_To.y ), y1 = max( a_From.y, a_To.y );
+	const __m128 fx = _mm_set1_ps( a_From.x ), fy = _mm_set1_ps( a_From.y );
+	const __m128 dx = _mm_set1_ps( d.x ), dy = _mm_set1_ps( d.y );
+	const __m128 lox = _mm_set1_ps( x0 - 2 ), hix = _mm_set1_ps( x1 + 2 );
+	const __m128 loy = _mm_set1_ps( y0 - 2 ), hiy = _mm_set1_ps( y1 + 2 );
+	const __m128 reach = _mm_set1_ps( 2 * (fabsf( d.x ) + fabsf( d.y )) );
+	const __m128 sign = _mm_set1_ps( -0.0f );
+	const TankArmy& army = game->m_Army;
+	const int team = flags[i] >> 2;
+	int best = -1;
+	float bestT = 0;
+	// cells under the segment, clipped to the grid: off-grid tanks cannot be hit
+	const int gx0 = max( 0, ((int)(x0 - 2) + gridOriginX) >> 4 ), gx1 = min( gridW - 1, ((int)(x1 + 2) + gridOriginX) >> 4 );
+	const int gy0 = max( 0, ((int)(y0 - 2) + gridOriginY) >> 4 ), gy1 = min( gridH - 1, ((int)(y1 + 2) + gridOriginY) >> 4 );
+	for ( int gy = gy0; gy <= gy1; gy++ )
+		for ( int gx = gx0; gx <= gx1; gx++ )
+			for ( GridRun run = TeamCell( team, gx, gy ); run.count; run.Advance() )
+				for ( unsigned int k = 0; k < run.count; k += 4 )
+				{
+					// lanes past the end get a position no segment reaches
+					float2 p[4];
+					for ( int l = 0; l < 4; l++ ) p[l] = (k + l < run.count) ? army.pos[run.index[k + l]] : float2( -1e9f, -1e9f );
+					const __m128 tx = _mm_set_ps( p[3].x, p[2].x, p[1].x, p[0].x );
+					const __m128 ty = _mm_set_ps( p[3].y, p[2].y, p[1].y, p[0].y );
+					const __m128 inside = _mm_and_ps( _mm_and_ps( _mm_cmpgt_ps( tx, lox ), _mm_cmplt_ps( tx, hix ) ),
+						_mm_and_ps( _mm_cmpgt_ps( ty, loy ), _mm_cmplt_ps( ty, hiy ) ) );
+					const __m128 rx = _mm_sub_ps( tx, fx ), ry = _mm_sub_ps( ty, fy );
+					const __m128 cross = _mm_andnot_ps( sign, _mm_sub_ps( _mm_mul_ps( dx, ry ), _mm_mul_ps( dy, rx ) ) );
+					int hits = _mm_movemask_ps( _mm_and_ps( inside, _mm_cmple_ps( cross, reach ) ) );
+					for ( int l = 0; hits; l++, hits >>= 1 ) if (hits & 1)
+					{
+						const unsigned int t = run.index[k + l];
+						if (!(army.flags[t] & TankArmy::ACTIVE)) continue; // already hit this frame
+						const float along = dot( p[l] - a_From, d );
+						if (best < 0 || along < bestT || (along == bestT && t < (unsigned int)best)) best = t, bestT = along;
+					}
+				}
+	return best;
 }
 
-// Tank::Fire - spawns a bullet
-void Tank::Fire( unsigned int party, float2& pos, float2& dir )
+// BulletPool::Tick - move all bullets, then sweep each one's path for a hit;
+// destroyed bullets are replaced by the last live one
+void BulletPool::Tick()
 {
-	for ( unsigned int i = 0; i < MAXBULLET; i++ ) 
-		if (!(bullet[i].flags & Bullet::ACTIVE))
+	const __m128 step = _mm_set1_ps( BULLETSPEED );
+	for ( unsigned int i = 0; i < count; i += 4 )
+	{
+		_mm_store_ps( px + i, _mm_add_ps( _mm_load_ps( px + i ), _mm_mul_ps( _mm_load_ps( vx + i ), step ) ) );
+		_mm_store_ps( py + i, _mm_add_ps( _mm_load_ps( py + i ), _mm_mul_ps( _mm_load_ps( vy + i ), step ) ) );
+	}
+	TankArmy& army = game->m_Army;
+	for ( unsigned int i = 0; i < count; )
+	{
+		const float2 pos( px[i], py[i] ), prevpos = pos - float2( vx[i], vy[i] ) * BULLETSPEED;
+		if (game->m_Render) game->m_Surface->AddLine( 2 * prevpos.x - pos.x, 2 * prevpos.y - pos.y, pos.x, pos.y, 0x555555 );
+		bool destroy = (pos.x < 0) || (pos.x > (SCRWIDTH - 1)) || (pos.y < 0) || (pos.y > (SCRHEIGHT - 1)); // off-screen
+		const int t = Sweep( i, prevpos, pos );
+		if (t >= 0)
+		{
+			// update counters
+			if (army.flags[t] & TankArmy::P1)
+				aliveP1--;
+			else
+				aliveP2--;
+
+			army.flags[t] &= TankArmy::P1 | TankArmy::P2;	// kill tank
+#ifndef SORTEDGRID
+			teamGrid[1 ^ (army.flags[t] >> 2)][Cell( army.gridX(t), army.gridY(t) )].remove(t);
+#endif
+			destroy = true;
+		}
+		if (!destroy) i++; else
 		{
-			bullet[i].flags |= Bullet::ACTIVE + party; // set owner, set active
-			bullet[i].pos = pos;
-			bullet[i].speed = dir;
-			break;
+			count--;
+			px[i] = px[count], py[i] = py[count];
+			vx[i] = vx[count], vy[i] = vy[count];
+			flags[i] = flags[count];
 		}
+	}
+}
+
+// TankArmy::Init - (re)allocate storage for a_Count tanks
+void TankArmy::Init( unsigned int a_Count )
+{
+	FREE64( pos ); FREE64( dir ); FREE64( target ); FREE64( maxspeed );
+	FREE64( flags ); FREE64( reloading ); FREE64( inGrid ); FREE64( smokeIdx );
+	FREE64( nextPos ); FREE64( fire );
+	count = a_Count;
+	pos = (float2*)MALLOC64( count * sizeof( float2 ) );
+	dir = (float2*)MALLOC64( count * sizeof( float2 ) );
+	target = (float2*)MALLOC64( count * sizeof( float2 ) );
+	maxspeed = (float*)MALLOC64( count * sizeof( float ) );
+	flags = (int*)MALLOC64( count * sizeof( int ) );
+	reloading = (int*)MALLOC64( count * sizeof( int ) );
+	inGrid = (unsigned char*)MALLOC64( count );
+	smokeIdx = (int*)MALLOC64( count * sizeof( int ) );
+	nextPos = (float2*)MALLOC64( count * sizeof( float2 ) );
+	fire = (unsigned char*)MALLOC64( count );
+	for ( unsigned int i = 0; i < count; i++ )
+	{
+		pos[i] = dir[i] = target[i] = nextPos[i] = float2( 0, 0 );
+		maxspeed[i] = 0;
+		flags[i] = reloading[i] = 0;
+		inGrid[i] = 1, fire[i] = 0;
+		smokeIdx[i] = -1;
+	}
+	smoke.Clear();
 }
 
-// Tank::Tick - update single tank
-void Tank::Tick()
+TankArmy::~TankArmy()
 {
-	if (!(flags & ACTIVE)) // dead tank
+	FREE64( pos ); FREE64( dir ); FREE64( target ); FREE64( maxspeed );
+	FREE64( flags ); FREE64( reloading ); FREE64( inGrid ); FREE64( smokeIdx );
+	FREE64( nextPos ); FREE64( fire );
+}
+
+// TankArmy::Fire - spawns a bullet
+void TankArmy::Fire( unsigned int i )
+{
+	bullets.Spawn( flags[i] & (P1 | P2), pos[i], dir[i] );
+}
+
+// neighbour avoidance: accumulate the evade force that a_Count tanks from a
+// grid cell exert on a tank at a_P. Tanks at distance zero (including the tank
+// itself) are skipped. Game::Init picks the widest kernel the CPU supports.
+typedef float2 (*EvadeKernel)( const float2* a_Pos, const unsigned int* a_Index, int a_Count, float2 a_P );
+
+static float2 EvadeScalar( const float2* a_Pos, const unsigned int* a_Index, int a_Count, float2 a_P )
+{
+	float2 force( 0, 0 );
+	for (int k = 0; k < a_Count; k++)
 	{
-		smoke.xpos = (int)pos.x;
-		smoke.ypos = (int)pos.y;
-		return smoke.Tick();
+		float2 d = a_P - a_Pos[a_Index[k]];
+		float squaredLength = d.x*d.x + d.y*d.y;
+
+		if (squaredLength == 0)
+			continue;
+		else if (squaredLength < 64)
+			force += normalize(d) * 2.0f;
+		else if (squaredLength < 256)
+			force += normalize(d) * 0.4f;
 	}
+	return force;
+}
 
-	float2 force = normalize( target - pos );
+// The SIMD kernels compute each neighbour's push exactly as EvadeScalar does
+// (IEEE sqrt and divide, no rsqrt estimate) and add the pushes in index order,
+// so every kernel gives bit-identical forces and the benchmark checksum does
+// not depend on the CPU. Only the distance and weight math is vectorised.
 
-	int grid_x = this->gridX();
-	int grid_y = this->gridY();
+// EvadeAdd - add the pushes of the lanes in a_Mask to a_Force, in lane order
+static inline void EvadeAdd( float2& a_Force, const float* a_X, const float* a_Y, int a_Mask, int a_Lanes )
+{
+	for ( int l = 0; l < a_Lanes; l++ ) if (a_Mask & (1 << l)) a_Force.x += a_X[l], a_Force.y += a_Y[l];
+}
 
-	if (!(grid_y < GRIDY - 1 && grid_x < GRIDX - 1 && grid_y > 0 && grid_x > 0))
+static float2 EvadeSSE( const float2* a_Pos, const unsigned int* a_Index, int a_Count, float2 a_P )
+{
+	const __m128 px = _mm_set1_ps( a_P.x ), py = _mm_set1_ps( a_P.y );
+	float2 force( 0, 0 );
+	for (int k = 0; k < a_Count; k += 4)
 	{
+		// lanes past the end point at the tank itself, giving d = 0
+		float2 p[4];
+		for (int l = 0; l < 4; l++) p[l] = (k + l < a_Count) ? a_Pos[a_Index[k + l]] : a_P;
+		const __m128 dx = _mm_sub_ps( px, _mm_set_ps( p[3].x, p[2].x, p[1].x, p[0].x ) );
+		const __m128 dy = _mm_sub_ps( py, _mm_set_ps( p[3].y, p[2].y, p[1].y, p[0].y ) );
+		const __m128 sq = _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) );
+		const __m128 near8 = _mm_cmplt_ps( sq, _mm_set1_ps( 64 ) ), far16 = _mm_cmplt_ps( sq, _mm_set1_ps( 256 ) );
+		const __m128 w = _mm_or_ps( _mm_and_ps( near8, _mm_set1_ps( 2.0f ) ), _mm_andnot_ps( near8, _mm_set1_ps( 0.4f ) ) );
+		const __m128 r = _mm_div_ps( _mm_set1_ps( 1.0f ), _mm_sqrt_ps( sq ) );
+		ALIGN( 16 ) float cx[4], cy[4];
+		_mm_store_ps( cx, _mm_mul_ps( _mm_mul_ps( dx, r ), w ) );
+		_mm_store_ps( cy, _mm_mul_ps( _mm_mul_ps( dy, r ), w ) );
+		EvadeAdd( force, cx, cy, _mm_movemask_ps( _mm_and_ps( far16, _mm_cmpgt_ps( sq, _mm_setzero_ps() ) ) ), 4 );
+	}
+	return force;
+}
+
+TARGET_AVX2 static float2 EvadeAVX2( const float2* a_Pos, const unsigned int* a_Index, int a_Count, float2 a_P )
+{
+	const __m256 px = _mm256_set1_ps( a_P.x ), py = _mm256_set1_ps( a_P.y );
+	const __m256i lane = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+	const float* base = (const float*)a_Pos;
+	float2 force( 0, 0 );
+	for (int k = 0; k < a_Count; k += 8)
+	{
+		// masked load: never touches index[] past a_Count; masked lanes gather p itself
+		const __m256i valid = _mm256_cmpgt_epi32( _mm256_set1_epi32( a_Count - k ), lane );
+		const __m256i idx = _mm256_slli_epi32( _mm256_maskload_epi32( (const int*)a_Index + k, valid ), 1 );
+		const __m256 vmask = _mm256_castsi256_ps( valid );
+		const __m256 ox = _mm256_mask_i32gather_ps( px, base, idx, vmask, 4 );
+		const __m256 oy = _mm256_mask_i32gather_ps( py, base + 1, idx, vmask, 4 );
+		const __m256 dx = _mm256_sub_ps( px, ox ), dy = _mm256_sub_ps( py, oy );
+		const __m256 sq = _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) );
+		const __m256 near8 = _mm256_cmp_ps( sq, _mm256_set1_ps( 64 ), _CMP_LT_OQ );
+		const __m256 far16 = _mm256_cmp_ps( sq, _mm256_set1_ps( 256 ), _CMP_LT_OQ );
+		const __m256 w = _mm256_blendv_ps( _mm256_set1_ps( 0.4f ), _mm256_set1_ps( 2.0f ), near8 );
+		const __m256 r = _mm256_div_ps( _mm256_set1_ps( 1.0f ), _mm256_sqrt_ps( sq ) );
+		ALIGN( 32 ) float cx[8], cy[8];
+		_mm256_store_ps( cx, _mm256_mul_ps( _mm256_mul_ps( dx, r ), w ) );
+		_mm256_store_ps( cy, _mm256_mul_ps( _mm256_mul_ps( dy, r ), w ) );
+		EvadeAdd( force, cx, cy, _mm256_movemask_ps( _mm256_and_ps( far16, _mm256_cmp_ps( sq, _mm256_setzero_ps(), _CMP_GT_OQ ) ) ), 8 );
+	}
+	return force;
+}
+
+static EvadeKernel evade = EvadeScalar;
+
+// SelectEvadeKernel - widest kernel supported by both the CPU and the OS
+static EvadeKernel SelectEvadeKernel()
+{
+	const unsigned int cpu = CpuFeatures();
+	if (cpu & CPU_AVX2) return EvadeAVX2;
+	return (cpu & CPU_SSE2) ? EvadeSSE : EvadeScalar;
+}
+
+// TankArmy::Tick - update single tank; only reads the grids and other tanks'
+// positions, so it can run on any thread. Grid changes, bullets and smoke are
+// deferred to TankArmy::Commit.
+void TankArmy::Tick( unsigned int idx, unsigned char a_Circle[16][64] )
+{
+	if (!(flags[idx] & ACTIVE)) // dead tank
+	{
+		nextPos[idx] = pos[idx];
+		return;
+	}
+
+	float2 pos = this->pos[idx];
+	float2& dir = this->dir[idx];
+	float2 force = normalize( target[idx] - pos );
+
+	int grid_x = gridX( idx );
+	int grid_y = gridY( idx );
+
+	if (!OnGrid( grid_x, grid_y ))
+	{
+		// off the grid: no neighbours to evade or shoot at, head for the target
 		dir += force;
 		dir = normalize(dir);
-		pos += dir * maxspeed * 0.5f;
-		if (active)
-		{
-			tankGrid[grid_y][grid_x].remove(this);
-			teamGrid[1 ^ (flags >> 2)][grid_y][grid_x].remove(this);
-			active = false;
-		}
+		nextPos[idx] = pos + dir * maxspeed[idx] * 0.5f;
 		return;
 	}
 
 	// evade mountain peaks
-	for ( unsigned int i = 0; i < 16; i++ )
+	float u = (pos.x - FIELDX0) * (1.0f / FIELDCELL), v = (pos.y - FIELDY0) * (1.0f / FIELDCELL);
+	if ((u >= 0) && (v >= 0) && (u < FIELDW - 1) && (v < FIELDH - 1))
 	{
-		float2 d( pos.x - peakx[i], pos.y - peaky[i] );
-		float sd = (d.x * d.x + d.y * d.y) * 0.2f;
+		int fx = (int)u, fy = (int)v;
+		float wu = u - fx, wv = v - fy;
+		const FieldSample* f = forceField + fx + fy * FIELDW;
+		force += (f[0].force * (1 - wu) + f[1].force * wu) * (1 - wv) + (f[FIELDW].force * (1 - wu) + f[FIELDW + 1].force * wu) * wv;
 
-		if (sd < 1500) 
+		// influence circles, only for the peaks that can reach this sample
+		for ( unsigned int i = 0, peaks = f->peaks; peaks; i++, peaks >>= 1 ) if (peaks & 1)
 		{
-			force += d * 0.03f * (peakh[i] / sd);
-			float r = sqrtf( sd );
-			mountainCircle[i][(int)r]++;
+			float2 d( pos.x - peakx[i], pos.y - peaky[i] );
+			float sd = (d.x * d.x + d.y * d.y) * 0.2f;
+			if (sd < 1500) a_Circle[i][(int)sqrtf( sd )]++;
 		}
 	}
 		
@@ -202,26 +672,12 @@ void Tank::Tick()
 	for (int i = -1; i < 2; i++)
 		for (int j = -1; j < 2; j++)
 		{
-			int curX = (grid_x + j) & GRIDXMASK;
-			int curY = (grid_y + i) & GRIDYMASK;
-			for (int k = 0; k < tankGrid[curY][curX].count; k++)
-			{
-				if (tankGrid[curY][curX].getTank(k) == this)
-					continue;
-
-				float2 d = pos - tankGrid[curY][curX].getTank(k)->pos;
-
-				float squaredLength = d.x*d.x + d.y*d.y;
-
-				if (squaredLength < 64)
-					force += normalize(d) * 2.0f;
-				else if (squaredLength < 256)
-					force += normalize(d) * 0.4f;
-			}
+			for ( GridRun run = TankCell( grid_x + j, grid_y + i ); run.count; run.Advance() )
+				force += evade( this->pos, run.index, run.count, pos );
 		}
 
 	// evade user dragged line
-	if ((flags & P1) && (game->m_LButton))
+	if ((flags[idx] & P1) && (game->m_LButton))
 	{
 		float x1 = (float)game->m_DStartX;
 		float y1 = (float)game->m_DStartY;
@@ -243,312 +699,744 @@ void Tank::Tick()
 	// update speed using accumulated force
 	dir += force;
 	dir = normalize(dir);
-	pos += dir * maxspeed * 0.5f;
-	int newGridX = gridX();
-	int newGridY = gridY();
-	if (!active)
-	{
-		active = true;
-		tankGrid[newGridY][newGridX].add(this);
-		teamGrid[1 ^ (flags >> 2)][newGridY][newGridX].add(this);
-	}
-	else if (newGridX != grid_x || newGridY != grid_y)
-	{
-		tankGrid[grid_y][grid_x].remove(this);
-		tankGrid[newGridY][newGridX].add(this);
-		teamGrid[1 ^ (flags >> 2)][grid_y][grid_x].remove(this);
-		teamGrid[1 ^ (flags >> 2)][newGridY][newGridX].add(this);
-	}
+	pos += dir * maxspeed[idx] * 0.5f;
+	nextPos[idx] = pos;
 
 	// shoot, if reloading completed
-	if (--reloading >= 0) 
+	if (--reloading[idx] >= 0) 
 		return;
 
-	unsigned int start = 0;
-	unsigned int end = MAXP1;
-
-	if (flags & P1)
+	if (Aim( idx, pos ))
 	{
-		start = MAXP1;
-		end = MAXP1 + MAXP2;
+		fire[idx] = 1; // shoot
+		reloading[idx] = 200; // and wait before next shot is ready
 	}
+}
 
-	int hstart = -7 * (dir.x < -0.1);
-	int hend = 7 * (dir.x > 0.1);
-	int vstart = -7 * (dir.y < -0.1);
-	int vend = 7 * (dir.y > 0.1);
-
-	for (int i = vstart; i <= vend; i++)
-		for (int j = hstart; j <= hend; j++)
+// TankArmy::Aim - true if an enemy tank is within range 100 and within 0.99999
+// of the firing direction. Squared form of the same test: the enemy must be ahead
+// and cross^2 < (1 - 0.99999^2) * |d|^2. Only the cells along the ray are walked,
+// one row or column of the major axis at a time, widened by AIMMARGIN for the
+// cone's width at full range and for the grid's truncating cell mapping.
+#define AIMRANGE		100.0f
+#define AIMTOLERANCE	(1 - 0.99999f * 0.99999f)
+#define AIMMARGIN		1.5f
+bool TankArmy::Aim( unsigned int idx, const float2& a_Pos )
+{
+	const float2 d = dir[idx], end = a_Pos + d * AIMRANGE;
+	const int enemy = flags[idx] >> 2;
+	const bool stepX = fabsf( d.x ) >= fabsf( d.y );
+	// a: major axis, b: minor axis, both in grid space
+	const float ox = (float)gridOriginX, oy = (float)gridOriginY;
+	float a0 = stepX ? a_Pos.x + ox : a_Pos.y + oy, a1 = stepX ? end.x + ox : end.y + oy;
+	float b0 = stepX ? a_Pos.y + oy : a_Pos.x + ox, b1 = stepX ? end.y + oy : end.x + ox;
+	if (a1 < a0) { float t = a0; a0 = a1; a1 = t; t = b0; b0 = b1; b1 = t; }
+	const float slope = (a1 > a0) ? (b1 - b0) / (a1 - a0) : 0;
+	// cells outside the grid hold no tanks, so the walk is clipped to it
+	const int majorCells = stepX ? gridW : gridH, minorCells = stepX ? gridH : gridW;
+	const int c0 = max( 0, (int)floorf( (a0 - AIMMARGIN) / GRIDSIZE ) ), c1 = min( majorCells - 1, (int)floorf( (a1 + AIMMARGIN) / GRIDSIZE ) );
+	for ( int c = c0; c <= c1; c++ )
+	{
+		const float s0 = max( a0, (float)(c * GRIDSIZE) ), s1 = min( a1, (float)((c + 1) * GRIDSIZE) );
+		const float e0 = b0 + (max( s0, a0 ) - a0) * slope, e1 = b0 + (max( s1, a0 ) - a0) * slope;
+		const int r0 = max( 0, (int)floorf( (min( e0, e1 ) - AIMMARGIN) / GRIDSIZE ) );
+		const int r1 = min( minorCells - 1, (int)floorf( (max( e0, e1 ) + AIMMARGIN) / GRIDSIZE ) );
+		for ( int r = r0; r <= r1; r++ )
 		{
-			int curX = (newGridX + j) & GRIDXMASK;
-			int curY = (newGridY + i) & GRIDYMASK;
-			int count = teamGrid[flags>>2][curY][curX].count;
-
-			for (int k = 0; k<count; k++)
+			const int curX = stepX ? c : r, curY = stepX ? r : c;
+			for ( GridRun run = TeamCell( enemy, curX, curY ); run.count; run.Advance() )
+			for ( unsigned int k = 0; k < run.count; k++ )
 			{
-				Tank* target = teamGrid[flags>>2][curY][curX].getTank(k);
-				float2 d = target->pos - pos;
-				float sqleng = d.x*d.x + d.y*d.y;
-
-				if ((sqleng < 10000) && (dot(normalize(d), dir) > 0.99999f))
-				{
-					Fire(flags & (P1 | P2), pos, dir); // shoot
-					reloading = 200; // and wait before next shot is ready
-					return;
-				}
+#ifdef SORTEDGRID
+				if (!(flags[run.index[k]] & ACTIVE)) continue; // a wreck until the grids are rebuilt
+#endif
+				const float2 o = pos[run.index[k]] - a_Pos;
+				const float sqleng = o.x * o.x + o.y * o.y, along = dot( o, d ), cross = o.x * d.y - o.y * d.x;
+				if ((sqleng < AIMRANGE * AIMRANGE) && (along > 0) && (cross * cross < AIMTOLERANCE * sqleng)) return true;
 			}
 		}
+	}
+	return false;
 }
 
-// Game::Init - Load data, setup playfield
-void Game::Init(bool loadState)
+// TankArmy::Commit - serial part of the tank update, called in tank order after
+// all jobs completed and nextPos has been swapped in (oldPos is the previous frame)
+void TankArmy::Commit( unsigned int idx, float2 oldPos )
 {
-	m_Heights = new Surface("testdata/heightmap.png");
-	m_Backdrop = new Surface(1024, 768);
-	m_Grid = new Surface(1024, 768);
+	if (!(flags[idx] & ACTIVE)) // dead tank
+	{
+		if (smokeIdx[idx] < 0) smokeIdx[idx] = (int)smoke.Spawn( (int)pos[idx].x, (int)pos[idx].y );
+		return;
+	}
 
-	Pixel* a1 = m_Grid->GetBuffer();
-	Pixel* a2 = m_Backdrop->GetBuffer();
-	Pixel* a3 = m_Heights->GetBuffer();
+	// a tank is in the grids exactly when its current position is on the grid
+	int newGridX = gridX( idx );
+	int newGridY = gridY( idx );
+	const bool onGrid = OnGrid( newGridX, newGridY );
+#ifdef SORTEDGRID
+	// the grids are rebuilt from inGrid and the new positions after this
+	inGrid[idx] = onGrid;
+	(void)oldPos;
+#else
+	const int team = 1 ^ (flags[idx] >> 2);
+	int grid_x = ((int)oldPos.x + gridOriginX) >> 4;
+	int grid_y = ((int)oldPos.y + gridOriginY) >> 4;
+	if (!onGrid)
+	{
+		if (inGrid[idx])
+		{
+			tankGrid[Cell( grid_x, grid_y )].remove(idx);
+			teamGrid[team][Cell( grid_x, grid_y )].remove(idx);
+			inGrid[idx] = 0;
+		}
+	}
+	else if (!inGrid[idx])
+	{
+		inGrid[idx] = 1;
+		tankGrid[Cell( newGridX, newGridY )].add(idx);
+		teamGrid[team][Cell( newGridX, newGridY )].add(idx);
+	}
+	else if (newGridX != grid_x || newGridY != grid_y)
+	{
+		tankGrid[Cell( grid_x, grid_y )].remove(idx);
+		tankGrid[Cell( newGridX, newGridY )].add(idx);
+		teamGrid[team][Cell( grid_x, grid_y )].remove(idx);
+		teamGrid[team][Cell( newGridX, newGridY )].add(idx);
+	}
+#endif
 
-	for ( int y = 0; y < 768; y++ ) 
-		for ( int idx = y * 1024, x = 0; x < 1024; x++, idx++ ) 
-			a1[idx] = (((x & 31) == 0) | ((y & 31) == 0)) ? 0x6600 : 0;
+	if (fire[idx])
+	{
+		Fire( idx );
+		fire[idx] = 0;
+	}
+}
 
-	for ( int y = 0; y < 767; y++ ) 
-		for ( int idx = y * 1024, x = 0; x < 1023; x++, idx++ ) 
+// BuildRings - midpoint circle for every radius, duplicates removed
+static void BuildRings()
+{
+	static unsigned char used[129][129];
+	int n = 0;
+	for ( int r = 0; r < 64; r++ )
+	{
+		ringStart[r] = n;
+		memset( used, 0, sizeof( used ) );
+		for ( int x = r, y = 0, err = 1 - r; x >= y; y++ )
 		{
-			float3 N = normalize(float3((float)(a3[idx + 1] & 255) - (a3[idx] & 255), 1.5f, (float)(a3[idx + 1024] & 255) - (a3[idx] & 255))), L(1, 4, 2.5f);
+			const int px[8] = { x, y, -y, -x, -x, -y, y, x }, py[8] = { y, x, x, y, -y, -x, -x, -y };
+			for ( int i = 0; i < 8; i++ ) if (!used[py[i] + 64][px[i] + 64])
+			{
+				used[py[i] + 64][px[i] + 64] = 1;
+				ringOffset[n].x = (short)px[i], ringOffset[n++].y = (short)py[i];
+			}
+			if (err < 0) err += 2 * y + 3;
+			else err += 2 * (y - x) + 5, x--;
+		}
+	}
+	ringStart[64] = n;
+}
 
-			float h = (float)(a3[x + y * 1024] & 255) * 0.0005f;
-			float dx = x - 512.f;
-			float dy = y - 384.f; 
-			float d = sqrtf(dx * dx + dy * dy);
-			float dt = dot(N, normalize(L));
+// DrawRing - add a_Color once to every pixel of ring a_R around (a_X, a_Y)
+static void DrawRing( Surface* a_Target, int a_X, int a_Y, int a_R, Pixel a_Color )
+{
+	Pixel* buffer = a_Target->GetBuffer();
+	const int pitch = a_Target->GetPitch(), w = a_Target->GetWidth(), h = a_Target->GetHeight();
+	const RingOffset* o = ringOffset + ringStart[a_R], *end = ringOffset + ringStart[a_R + 1];
+	a_Target->MarkDirty( a_X - a_R, a_Y - a_R, a_X + a_R, a_Y + a_R );
+	if ((a_X >= a_R) && (a_Y >= a_R) && (a_X + a_R < w) && (a_Y + a_R < h))
+	{
+		// fully on screen: no per-pixel clipping
+		Pixel* c = buffer + a_X + a_Y * pitch;
+		for ( ; o < end; o++ ) c[o->x + o->y * pitch] = AddBlend( c[o->x + o->y * pitch], a_Color );
+	}
+	else for ( ; o < end; o++ )
+	{
+		const int x = a_X + o->x, y = a_Y + o->y;
+		if ((x >= 0) && (y >= 0) && (x < w) && (y < h)) buffer[x + y * pitch] = AddBlend( buffer[x + y * pitch], a_Color );
+	}
+}
 
-			int u = max(0, min(1023, (int)(x - dx * h)));
-			int v = max(0, min(767, (int)(y - dy * h)));
-			int r = (int)Rand(255);
+// Rejected - report a_Value of option a_Name when a_Bad; the option then keeps
+// its previous value
+static bool Rejected( const char* a_Name, const char* a_Value, bool a_Bad )
+{
+	if (a_Bad) printf( "invalid value for %s: %s\n", a_Name, a_Value );
+	return a_Bad;
+}
 
-			a2[idx] = AddBlend(a1[u + v * 1024], ScaleColor(ScaleColor(0x33aa11, r) + ScaleColor(0xffff00, (255 - r)), (int)(max(0.0f, dt) * 80.0f) + 10));
-		}
+// GameConfig::Set - apply one option; returns the number of values it used,
+// or -1 if the name is unknown or values are missing. Sizes, spacing and the
+// tick rate must be positive, pool sizes not negative.
+int GameConfig::Set( const char* a_Name, const char* a_Value1, const char* a_Value2 )
+{
+	if (!a_Value1) return -1;
+	const int i1 = atoi( a_Value1 );
+	const float f1 = (float)atof( a_Value1 );
+	if (!strcmp( a_Name, "p1" )) { if (!Rejected( a_Name, a_Value1, i1 <= 0 )) p1 = (unsigned int)i1; return 1; }
+	if (!strcmp( a_Name, "p2" )) { if (!Rejected( a_Name, a_Value1, i1 <= 0 )) p2 = (unsigned int)i1; return 1; }
+	if (!strcmp( a_Name, "bullets" )) { if (!Rejected( a_Name, a_Value1, i1 < 0 )) bullets = (unsigned int)i1; return 1; }
+	if (!strcmp( a_Name, "spacing" )) { if (!Rejected( a_Name, a_Value1, !(f1 > 0) )) spacing = f1; return 1; }
+	if (!strcmp( a_Name, "smoke" )) { if (!Rejected( a_Name, a_Value1, i1 < 0 )) smoke = (unsigned int)i1; return 1; }
+	if (!strcmp( a_Name, "tickrate" )) { if (!Rejected( a_Name, a_Value1, !(f1 > 0) )) tickRate = f1; return 1; }
+	if (!strcmp( a_Name, "uncapped" )) return uncapped = i1, 1;
+	if (!strcmp( a_Name, "world" ) && a_Value2)
+	{
+		const int i2 = atoi( a_Value2 );
+		if (!Rejected( a_Name, a_Value1, i1 <= 0 ) && !Rejected( a_Name, a_Value2, i2 <= 0 )) worldX = i1, worldY = i2;
+		return 2;
+	}
+	return -1;
+}
 
-	for (int i = 0; i < 720; i++)
+// GameConfig::Load - read "name value(s)" lines; '#' starts a comment line
+bool GameConfig::Load( const char* a_File )
+{
+	FILE* f = fopen( a_File, "r" );
+	if (!f) return false;
+	char line[256];
+	while (fgets( line, sizeof( line ), f ))
 	{
-		sinTable[i] = sinf((float)i * PI / 360.0f);
-		cosTable[i] = cosf((float)i * PI / 360.0f);
+		char name[64], value1[64], value2[64];
+		const int n = sscanf( line, "%63s %63s %63s", name, value1, value2 );
+		if ((n > 0) && (name[0] != '#') && (Set( name, (n > 1) ? value1 : 0, (n > 2) ? value2 : 0 ) < 0))
+			printf( "%s: unknown option '%s'\n", a_File, name );
 	}
-	m_P1Sprite = new Sprite( new Surface( "testdata/p1tank.tga" ), 1, Sprite::FLARE );
-	m_P2Sprite = new Sprite( new Surface( "testdata/p2tank.tga" ), 1, Sprite::FLARE );
-	m_PXSprite = new Sprite( new Surface( "testdata/deadtank.tga" ), 1, Sprite::BLACKFLARE );
-	m_Smoke = new Sprite( new Surface( "testdata/smoke.tga" ), 10, Sprite::FLARE );
+	fclose( f );
+	return true;
+}
 
-	if (!loadState)
+// GameConfig::Parse - pick the options out of the command line: -p1 <n>,
+// -p2 <n>, -bullets <n>, -world <w> <h>, -spacing <d> and -config <file>;
+// other arguments are left for their own parsers
+void GameConfig::Parse( int argc, char** argv )
+{
+	for ( int i = 1; i < argc; i++ ) if (argv[i][0] == '-')
 	{
-		m_Tank = new Tank*[MAXP1 + MAXP2];
-		// create blue tanks
-		for (unsigned int i = 0; i < MAXP1; i++)
+		const char* value1 = (i + 1 < argc) ? argv[i + 1] : 0, *value2 = (i + 2 < argc) ? argv[i + 2] : 0;
+		if (!strcmp( argv[i], "-config" ) && value1)
 		{
-			Tank* t = m_Tank[i] = new Tank();
-			t->pos = float2((float)((i % 40) * 20) - 500, (float)((i / 40) * 20)- 500);
-			t->target = float2(SCRWIDTH, SCRHEIGHT); // initially move to bottom right corner
-			t->dir = float2(0, 0);
-			t->flags = Tank::ACTIVE | Tank::P1;
-			t->maxspeed = (i < (MAXP1 / 2)) ? 0.65f : 0.45f;
-			t->id = i;
-
-			int grid_x = t->gridX();
-			int grid_y = t->gridY();
-
-			if (!(grid_y < GRIDY - 1 && grid_x < GRIDX - 1 && grid_y > 0 && grid_x > 0))
-			{
-				t->active = false;
-				continue;
-			}
-
-			tankGrid[grid_y][grid_x].add(t);
-			teamGrid[1][grid_y][grid_x].add(t);
+			if (!Load( value1 )) printf( "could not read %s\n", value1 );
+			i++;
 		}
+		else
+		{
+			const int used = Set( argv[i] + 1, value1, value2 );
+			if (used > 0) i += used;
+		}
+	}
+}
 
+// terrain shading: the backdrop is a pure function of the heightmap file and
+// these values, which together key the backdrop cache. Raise version when the
+// shading code changes.
+static const struct BackdropParams
+{
+	float light[3], normalY, displace, shade, ambient;
+	Pixel grass, sand, gridLine;
+	int gridSpacing, version;
+} backdropParams = { { 1, 4, 2.5f }, 1.5f, 0.0005f, 80, 10, 0x33aa11, 0xffff00, 0x6600, 32, 1 };
+
+#define BACKDROPFILE	"backdrop.cache"	// delete it to force a rebuild
+#define BACKDROPMAGIC	0x4b444b42	// "BKDK"
+#define BACKDROPBAND	32			// rows per backdrop job
+struct BackdropHeader { unsigned int magic, width, height, pad; unsigned long long key; };
+
+// PixelNoise - grass/sand mix of a backdrop pixel, 0..255; hashed from the
+// position, so any band of rows can be shaded on its own
+static inline int PixelNoise( unsigned int x, unsigned int y )
+{
+	unsigned int h = x * 0x9e3779b1u ^ y * 0x85ebca77u;
+	h ^= h >> 15, h *= 0x2c1b3c6du, h ^= h >> 12, h *= 0x297a2d39u, h ^= h >> 15;
+	return (int)(h & 255);
+}
 
-		// create red tanks
-		for (unsigned int i = 0; i < MAXP2; i++)
+// BackdropJob - shades rows [first, last) of the backdrop: per pixel the
+// lambert term of the heightmap normal, and a lookup into the grid overlay
+// displaced away from the screen centre by the height. The float part runs
+// four pixels per SSE iteration; the colour mix and the overlay lookup are
+// per pixel.
+class BackdropJob : public Job
+{
+public:
+	void Main()
+	{
+		const BackdropParams& bp = backdropParams;
+		const float ll = sqrtf( bp.light[0] * bp.light[0] + bp.light[1] * bp.light[1] + bp.light[2] * bp.light[2] );
+		const float lx = bp.light[0] / ll, ly = bp.light[1] / ll, lz = bp.light[2] / ll;
+		for ( int y = first; y < last; y++ )
 		{
-			Tank* t = m_Tank[i + MAXP1] = new Tank();
-			t->pos = float2((float)((i % 50) * 20) + 700, (float)((i / 50) * 20) - 500);
-			//t->pos = float2((float)((i % 50) * 20 + 900), (float)((i / 50) * 20 + 600));
-			t->target = float2(424, 336); // move to player base
-			t->dir = float2(0, 0);
-			t->flags = Tank::ACTIVE | Tank::P2;
-			t->maxspeed = 0.3f;
-			t->id = i + MAXP1;
-
-			int grid_x = t->gridX();
-			int grid_y = t->gridY();
-
-			if (!(grid_y < GRIDY - 1 && grid_x < GRIDX - 1 && grid_y > 0 && grid_x > 0))
+			const Pixel* h = heights + y * SCRWIDTH;
+			int shade[SCRWIDTH], u[SCRWIDTH], v[SCRWIDTH];
+			int x = 0;
+			for ( ; x + 4 <= SCRWIDTH - 1; x += 4 )
 			{
-				t->active = false;
-				continue;
+				const __m128i mask = _mm_set1_epi32( 255 );
+				const __m128i h0 = _mm_and_si128( _mm_loadu_si128( (const __m128i*)(h + x) ), mask );
+				const __m128 c = _mm_cvtepi32_ps( h0 );
+				const __m128 nx = _mm_sub_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_loadu_si128( (const __m128i*)(h + x + 1) ), mask ) ), c );
+				const __m128 nz = _mm_sub_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_loadu_si128( (const __m128i*)(h + x + SCRWIDTH) ), mask ) ), c );
+				const __m128 ny = _mm_set1_ps( bp.normalY );
+				const __m128 len = _mm_sqrt_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( nx, nx ), _mm_mul_ps( ny, ny ) ), _mm_mul_ps( nz, nz ) ) );
+				const __m128 dt = _mm_div_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( nx, _mm_set1_ps( lx ) ), _mm_mul_ps( ny, _mm_set1_ps( ly ) ) ), _mm_mul_ps( nz, _mm_set1_ps( lz ) ) ), len );
+				const __m128 lit = _mm_add_ps( _mm_mul_ps( _mm_max_ps( dt, _mm_setzero_ps() ), _mm_set1_ps( bp.shade ) ), _mm_set1_ps( bp.ambient ) );
+				_mm_storeu_si128( (__m128i*)(shade + x), _mm_cvttps_epi32( lit ) );
+				// displace the overlay lookup away from the screen centre
+				const __m128 fx = _mm_setr_ps( (float)x, (float)(x + 1), (float)(x + 2), (float)(x + 3) ), fy = _mm_set1_ps( (float)y );
+				const __m128 d = _mm_mul_ps( c, _mm_set1_ps( bp.displace ) );
+				const __m128 du = _mm_sub_ps( fx, _mm_mul_ps( _mm_sub_ps( fx, _mm_set1_ps( SCRWIDTH / 2 ) ), d ) );
+				const __m128 dv = _mm_sub_ps( fy, _mm_mul_ps( _mm_sub_ps( fy, _mm_set1_ps( SCRHEIGHT / 2 ) ), d ) );
+				_mm_storeu_si128( (__m128i*)(u + x), _mm_cvttps_epi32( du ) );
+				_mm_storeu_si128( (__m128i*)(v + x), _mm_cvttps_epi32( dv ) );
+			}
+			for ( ; x < SCRWIDTH - 1; x++ )
+			{
+				const float c = (float)(h[x] & 255), nx = (float)(h[x + 1] & 255) - c, nz = (float)(h[x + SCRWIDTH] & 255) - c, ny = bp.normalY;
+				const float dt = (nx * lx + ny * ly + nz * lz) / sqrtf( nx * nx + ny * ny + nz * nz );
+				const float d = c * bp.displace;
+				shade[x] = (int)(max( dt, 0.0f ) * bp.shade + bp.ambient);
+				u[x] = (int)((float)x - ((float)x - SCRWIDTH / 2) * d), v[x] = (int)((float)y - ((float)y - SCRHEIGHT / 2) * d);
+			}
+			Pixel* dst = backdrop + y * SCRWIDTH;
+			for ( x = 0; x < SCRWIDTH - 1; x++ )
+			{
+				const int r = PixelNoise( x, y );
+				const int gu = max( 0, min( SCRWIDTH - 1, u[x] ) ), gv = max( 0, min( SCRHEIGHT - 1, v[x] ) );
+				dst[x] = AddBlend( grid[gu + gv * SCRWIDTH], ScaleColor( ScaleColor( bp.grass, r ) + ScaleColor( bp.sand, 255 - r ), shade[x] ) );
 			}
-
-			tankGrid[grid_y][grid_x].add(t);
-			teamGrid[0][grid_y][grid_x].add(t);
 		}
 	}
-	else
+	const Pixel* heights, *grid;
+	Pixel* backdrop;
+	int first, last;
+};
+static BackdropJob backdropJob[MAXJOBS];
+
+// Game::BuildBackdrop - load the shaded backdrop from the cache if it was made
+// from the same heightmap file and parameters, otherwise shade it in row
+// bands on the job threads and write the cache
+void Game::BuildBackdrop()
+{
+	if (!m_Backdrop) m_Backdrop = new Surface( SCRWIDTH, SCRHEIGHT ); // m_Tracks keeps pointing at it across Inits
+	Pixel* dst = m_Backdrop->GetBuffer();
+	memset( dst, 0, SCRWIDTH * SCRHEIGHT * sizeof( Pixel ) ); // the last row and column stay black
+	unsigned long long key = 0xcbf29ce484222325ULL;
 	{
-		ifstream loadFile("save.state");
-
-		if (!loadFile.is_open())
-			return;
-
-		string line;
-		int teamFlag = 2;
-
-		if (getline(loadFile, line))
+		MappedFile heightmap( "testdata/heightmap.png" );
+		for ( size_t i = 0; i < heightmap.GetSize(); i++ ) key = (key ^ heightmap.GetData()[i]) * 0x100000001b3ULL;
+		const unsigned char* p = (const unsigned char*)&backdropParams;
+		for ( size_t i = 0; i < sizeof( backdropParams ); i++ ) key = (key ^ p[i]) * 0x100000001b3ULL;
+		MappedFile cache( BACKDROPFILE );
+		const BackdropHeader* header = (const BackdropHeader*)cache.GetData();
+		if (header && (cache.GetSize() == sizeof( BackdropHeader ) + SCRWIDTH * SCRHEIGHT * sizeof( Pixel )) && (header->magic == BACKDROPMAGIC) &&
+			(header->width == SCRWIDTH) && (header->height == SCRHEIGHT) && (header->key == key))
 		{
-			delete m_Tank;
-			m_Tank = new Tank*[stoi(line)];
+			memcpy( dst, header + 1, SCRWIDTH * SCRHEIGHT * sizeof( Pixel ) );
+			return;
 		}
+	}
 
-		float2 bluTarget;
-		if (getline(loadFile, line))
+	m_Heights = Surface::Asset( "testdata/heightmap.png" ); // decoded once, reused when a later Init shades again
+	m_Grid = new Surface( SCRWIDTH, SCRHEIGHT );
+	Pixel* grid = m_Grid->GetBuffer();
+	for ( int y = 0; y < SCRHEIGHT; y++ ) for ( int x = 0; x < SCRWIDTH; x++ )
+		grid[x + y * SCRWIDTH] = (((x % backdropParams.gridSpacing) == 0) | ((y % backdropParams.gridSpacing) == 0)) ? backdropParams.gridLine : 0;
+	const bool shaded = m_Heights->GetBuffer() != 0;
+	if (shaded)
+	{
+		JobManager* jm = JobManager::GetJobManager();
+		const int jobs = (SCRHEIGHT - 1 + BACKDROPBAND - 1) / BACKDROPBAND;
+		for ( int i = 0; i < jobs; i++ )
 		{
-			string::size_type sz;
-			bluTarget.x = std::stof(line, &sz);
-			bluTarget.y = std::stof(line.substr(sz));
+			backdropJob[i].heights = m_Heights->GetBuffer(), backdropJob[i].grid = grid, backdropJob[i].backdrop = dst;
+			backdropJob[i].first = i * BACKDROPBAND, backdropJob[i].last = min( (i + 1) * BACKDROPBAND, SCRHEIGHT - 1 );
+			jm->AddJob2( &backdropJob[i] );
 		}
+		jm->RunJobs();
+	}
+	delete m_Grid;
+	m_Heights = m_Grid = 0;
+	if (!shaded) return;
+
+	FILE* f = fopen( BACKDROPFILE, "wb" );
+	if (!f) return;
+	BackdropHeader header = { BACKDROPMAGIC, SCRWIDTH, SCRHEIGHT, 0, key };
+	fwrite( &header, sizeof( header ), 1, f );
+	fwrite( dst, sizeof( Pixel ), SCRWIDTH * SCRHEIGHT, f );
+	fclose( f );
+}
 
-		int i = 0;
+// Game::Init - Load data, setup playfield
+void Game::Init(bool loadState)
+{
+	if (!JobManager::GetJobManager())
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo( &info );
+		const unsigned int cores = (unsigned int)info.dwNumberOfProcessors;
+#else
+		const unsigned int cores = (unsigned int)sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+		JobManager::CreateJobManager( min( cores, (unsigned int)MAXJOBTHREADS ) );
+	}
+	m_Uncapped = m_Config.uncapped != 0;
 
-		while (getline(loadFile, line))
-		{
-			if (line == "-")
-				break;
-
-			Tank* t = m_Tank[i] = new Tank();
-
-			string::size_type sz;
-			string::size_type fullSize = 0;
-
-			t->flags = std::stoi(line, &sz);
-			fullSize += sz;
-
-			float x1 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			float y1 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			t->pos = float2(x1, y1);
-			t->target = bluTarget;
-			float x2 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			float y2 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			t->dir = float2(x2, y2);
-			t->maxspeed = (i < (MAXP1 / 2)) ? 0.65f : 0.45f;
-			i++;
+	BuildBackdrop();
+	BakeMountains();
+	m_Tracks.Init( m_Backdrop );
 
-		}
+	BuildRings();
+	if (!m_P1Sprite) // loaded once, a later Init only resets the battle
+	{
+		m_P1Sprite = new Sprite( new Surface( "testdata/p1tank.tga" ), 1, Sprite::FLARE );
+		m_P2Sprite = new Sprite( new Surface( "testdata/p2tank.tga" ), 1, Sprite::FLARE );
+		m_PXSprite = new Sprite( new Surface( "testdata/deadtank.tga" ), 1, Sprite::BLACKFLARE );
+		m_Smoke = new Sprite( new Surface( "testdata/smoke.tga" ), 10, Sprite::FLARE );
+	}
 
-		float2 redTarget;
-		if (getline(loadFile, line))
-		{
-			string::size_type sz;
-			redTarget.x = std::stof(line, &sz);
-			redTarget.y = std::stof(line.substr(sz));
-		}
+	game = this; // for global reference
+	m_Surface->TrackDirty(); // Tick restores only the tiles drawn to last frame
+	m_LButton = m_PrevButton = false;
+
+	evade = SelectEvadeKernel();
+
+	InitGrids( m_Config.worldX, m_Config.worldY );
+	if (!loadState || !LoadState()) SpawnArmies();
+}
+
+// Formation - position of tank k in a block of a_Columns columns, a_Spacing apart
+static inline float2 Formation( unsigned int k, unsigned int a_Columns, float2 a_TopLeft, float a_Spacing )
+{
+	return float2( a_TopLeft.x + (k % a_Columns) * a_Spacing, a_TopLeft.y + (k / a_Columns) * a_Spacing );
+}
 
-		while (getline(loadFile, line))
+// FormationColumns - a_Min columns, or a square block for larger armies
+static unsigned int FormationColumns( unsigned int a_Count, unsigned int a_Min )
+{
+	return max( a_Min, (unsigned int)ceilf( sqrtf( (float)a_Count ) ) );
+}
+
+// Game::SpawnArmies - start a new battle: both armies in formation, no bullets.
+// The blue block keeps its right column at x = 280, the red block its left
+// column at x = 700, so larger armies grow away from each other.
+void Game::SpawnArmies()
+{
+	const unsigned int p1 = m_Config.p1, p2 = m_Config.p2;
+	const float spacing = m_Config.spacing;
+	ClearGrids();
+	bullets.Init( m_Config.bullets );
+	m_Army.Init( p1 + p2 );
+	// create blue tanks
+	const unsigned int columns1 = FormationColumns( p1, 40 );
+	for (unsigned int i = 0; i < p1; i++)
+	{
+		m_Army.pos[i] = Formation( i, columns1, float2( 280 - (columns1 - 1) * spacing, -500 ), spacing );
+		m_Army.target[i] = float2(SCRWIDTH, SCRHEIGHT); // initially move to bottom right corner
+		m_Army.dir[i] = float2(0, 0);
+		m_Army.flags[i] = TankArmy::ACTIVE | TankArmy::P1;
+		m_Army.maxspeed[i] = (i < (p1 / 2)) ? 0.65f : 0.45f;
+	}
+
+	// create red tanks
+	const unsigned int columns2 = FormationColumns( p2, 50 );
+	for (unsigned int i = 0; i < p2; i++)
+	{
+		unsigned int t = i + p1;
+		m_Army.pos[t] = Formation( i, columns2, float2( 700, -500 ), spacing );
+		m_Army.target[t] = float2(424, 336); // move to player base
+		m_Army.dir[t] = float2(0, 0);
+		m_Army.flags[t] = TankArmy::ACTIVE | TankArmy::P2;
+		m_Army.maxspeed[t] = 0.3f;
+	}
+
+	// grid the tanks that start inside it
+	for ( unsigned int t = 0; t < m_Army.count; t++ )
+	{
+		int grid_x = m_Army.gridX(t);
+		int grid_y = m_Army.gridY(t);
+
+		if (!OnGrid( grid_x, grid_y ))
 		{
-			Tank* t = m_Tank[i] = new Tank();
-
-			string::size_type sz;
-			string::size_type fullSize = 0;
-
-			t->flags = std::stoi(line, &sz);
-			fullSize += sz;
-
-			float x1 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			float y1 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			t->pos = float2(x1, y1);
-			t->target = redTarget;
-			float x2 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			float y2 = std::stof(line.substr(fullSize), &sz);
-			fullSize += sz;
-			t->dir = float2(x2, y2);
-			t->maxspeed = (i < (MAXP1 / 2)) ? 0.65f : 0.45f;
-			i++;
+			m_Army.inGrid[t] = 0;
+			continue;
 		}
 
-		loadFile.close();
+#ifndef SORTEDGRID
+		tankGrid[Cell( grid_x, grid_y )].add(t);
+		teamGrid[1 ^ (m_Army.flags[t] >> 2)][Cell( grid_x, grid_y )].add(t);
+#endif
 	}
 
-	for (unsigned int i = 0; i < MAXBULLET; i++)
-		bullet[i].flags = 0;
+	aliveP1 = p1;
+	aliveP2 = p2;
+#ifdef SORTEDGRID
+	RebuildGrids();
+#endif
+}
 
-	aliveP1 = MAXP1;
-	aliveP2 = MAXP2;
+// Game::UpdateBullets - move bullets, kill tanks they hit
+void Game::UpdateBullets()
+{
+	bullets.Tick();
+}
 
-	game = this; // for global reference
-	m_LButton = m_PrevButton = false;
+// Game::UpdateTanks - tick all tanks in parallel, then apply grid moves, shots
+// and smoke in tank order so the outcome does not depend on the thread count
+void Game::UpdateTanks()
+{
+	JobManager* jm = JobManager::GetJobManager();
+	unsigned int jobs = (m_Army.count + TANKSPERJOB - 1) / TANKSPERJOB;
+	unsigned int perJob = TANKSPERJOB;
+	if (jobs > MAXJOBS) jobs = MAXJOBS, perJob = (m_Army.count + MAXJOBS - 1) / MAXJOBS;
+	for ( unsigned int i = 0; i < jobs; i++ )
+	{
+		tankJob[i].first = i * perJob;
+		tankJob[i].last = min( (i + 1) * perJob, m_Army.count );
+		jm->AddJob2( &tankJob[i] );
+	}
+	jm->RunJobs();
+
+	for ( unsigned int i = 0; i < jobs; i++ )
+		for ( int p = 0; p < 16; p++ ) for ( int r = 0; r < 64; r++ )
+			mountainCircle[p][r] += tankJob[i].circle[p][r];
+
+	float2* oldPos = m_Army.pos;
+	m_Army.pos = m_Army.nextPos;
+	m_Army.nextPos = oldPos;
+	for ( unsigned int i = 0; i < m_Army.count; i++ ) 
+		m_Army.Commit( i, oldPos[i] );
+	m_Army.smoke.Tick();
+#ifdef SORTEDGRID
+	RebuildGrids();
+#endif
 }
 
-// Game::DrawTanks - draw the tanks
-void Game::DrawTanks()
+// Game::BakeMountains - rebuild the mountain force field from the peak tables
+void Game::BakeMountains()
 {
-	for ( unsigned int i = 0; i < (MAXP1 + MAXP2); i++ )
+	if (!forceField) forceField = (FieldSample*)MALLOC64( FIELDW * FIELDH * sizeof( FieldSample ) );
+	// a sample's peak mask must cover every position that reads it
+	const float reach = PEAKRANGE + FIELDCELL * 1.5f;
+	for ( int y = 0; y < FIELDH; y++ ) for ( int x = 0; x < FIELDW; x++ )
 	{
-		Tank* t = m_Tank[i];
-		float x = t->pos.x, y = t->pos.y;
-		float2 p1( x + 70 * t->dir.x + 22 * t->dir.y, y + 70 * t->dir.y - 22 * t->dir.x );
-		float2 p2( x + 70 * t->dir.x - 22 * t->dir.y, y + 70 * t->dir.y + 22 * t->dir.x );
+		FieldSample& f = forceField[x + y * FIELDW];
+		float2 pos( (float)(FIELDX0 + x * FIELDCELL), (float)(FIELDY0 + y * FIELDCELL) );
+		f.force = float2( 0, 0 );
+		f.peaks = 0;
+		for ( unsigned int i = 0; i < 16; i++ )
+		{
+			float2 d( pos.x - peakx[i], pos.y - peaky[i] );
+			float sd = (d.x * d.x + d.y * d.y) * 0.2f;
+			if ((sd > 0) && (sd < 1500)) f.force += d * 0.03f * (peakh[i] / sd);
+			float cx = pos.x + FIELDCELL * 0.5f - peakx[i], cy = pos.y + FIELDCELL * 0.5f - peaky[i];
+			if ((cx * cx + cy * cy) < (reach * reach)) f.peaks |= 1 << i;
+		}
+	}
+}
+
+// Game::SetPeak - move or resize a mountain peak; rebakes the force field
+void Game::SetPeak( int a_Idx, float a_X, float a_Y, float a_Height )
+{
+	peakx[a_Idx] = a_X, peaky[a_Idx] = a_Y, peakh[a_Idx] = a_Height;
+	BakeMountains();
+}
+
+// TrackLayer::Init - no wear yet
+void TrackLayer::Init( Surface* a_Backdrop )
+{
+	FREE64( wear ); FREE64( worn ); FREE64( changed );
+	tilesX = SCRWIDTH / DIRTYTILE, tilesY = SCRHEIGHT / DIRTYTILE;
+	wear = (unsigned char*)MALLOC64( SCRWIDTH * SCRHEIGHT );
+	worn = (unsigned char*)MALLOC64( tilesX * tilesY );
+	changed = (unsigned char*)MALLOC64( tilesX * tilesY );
+	memset( wear, 0, SCRWIDTH * SCRHEIGHT );
+	memset( worn, 0, tilesX * tilesY );
+	memset( changed, 0, tilesX * tilesY );
+	backdrop = a_Backdrop;
+}
+
+TrackLayer::~TrackLayer()
+{
+	FREE64( wear ); FREE64( worn ); FREE64( changed );
+}
 
-		if (!(m_Tank[i]->flags & Tank::ACTIVE)) 
-			m_PXSprite->Draw( (int)x - 4, (int)y - 4, m_Surface ); // draw dead tank
-		else if (t->flags & Tank::P1) // draw blue tank
+// WornSpan - Surface::Restore span: backdrop minus 3 per wear step in each
+// colour channel, saturating at 0 (the same as SubBlend with 0x030303 once
+// per step), 16 pixels per SSE2 iteration; tiles without wear are copied
+static void WornSpan( void* a_Tracks, Pixel* a_Dst, int a_X, int a_Y, int a_Width )
+{
+	const TrackLayer& tracks = *(const TrackLayer*)a_Tracks;
+	const Pixel* src = tracks.backdrop->GetBuffer() + a_X + a_Y * tracks.backdrop->GetPitch();
+	const unsigned char* wear = tracks.wear + a_X + a_Y * SCRWIDTH, *worn = tracks.worn + (a_Y / DIRTYTILE) * tracks.tilesX;
+	const __m128i rgb = _mm_set1_epi32( 0xffffff ), zero = _mm_setzero_si128();
+	int x = 0;
+	for ( ; x + DIRTYTILE <= a_Width; x += DIRTYTILE )
+	{
+		const __m128i* s = (const __m128i*)(src + x);
+		__m128i* d = (__m128i*)(a_Dst + x);
+		if (!worn[(a_X + x) / DIRTYTILE])
 		{
-			m_P1Sprite->Draw( (int)x - 4, (int)y - 4, m_Surface );
-			m_Surface->Line( x, y, x + 8 * t->dir.x, y + 8 * t->dir.y, 0x4444ff );
+			for ( int i = 0; i < 4; i++ ) _mm_storeu_si128( d + i, _mm_loadu_si128( s + i ) );
+			continue;
 		}
-		else // draw red tank
+		const __m128i w = _mm_loadu_si128( (const __m128i*)(wear + x) );
+		const __m128i w3 = _mm_add_epi8( w, _mm_add_epi8( w, w ) ), lo = _mm_unpacklo_epi8( w3, w3 ), hi = _mm_unpackhi_epi8( w3, w3 );
+		const __m128i sub[4] = { _mm_unpacklo_epi16( lo, lo ), _mm_unpackhi_epi16( lo, lo ), _mm_unpacklo_epi16( hi, hi ), _mm_unpackhi_epi16( hi, hi ) };
+		for ( int i = 0; i < 4; i++ )
 		{
-			m_P2Sprite->Draw( (int)x - 4, (int)y - 4, m_Surface );
-			m_Surface->Line( x, y, x + 8 * t->dir.x, y + 8 * t->dir.y, 0xff4444 );
+			// SubBlend clears the alpha byte of the pixels it touches
+			const __m128i p = _mm_loadu_si128( s + i ), touched = _mm_cmpgt_epi32( sub[i], zero );
+			_mm_storeu_si128( d + i, _mm_subs_epu8( _mm_andnot_si128( _mm_andnot_si128( rgb, touched ), p ), _mm_and_si128( sub[i], rgb ) ) );
 		}
+	}
+	for ( ; x < a_Width; x++ ) a_Dst[x] = wear[x] ? SubBlend( src[x], wear[x] * 0x030303 ) : src[x];
+}
+
+// TrackLayer::Restore - restore the dirty tiles of a_Screen with the tracks
+// worn in; tiles that gained wear since the last call count as dirty too
+void TrackLayer::Restore( Surface* a_Screen )
+{
+	for ( int ty = 0; ty < tilesY; ty++ ) for ( int tx = 0; tx < tilesX; tx++ ) if (changed[tx + ty * tilesX])
+	{
+		changed[tx + ty * tilesX] = 0, worn[tx + ty * tilesX] = 1;
+		a_Screen->MarkDirty( tx * DIRTYTILE, ty * DIRTYTILE, tx * DIRTYTILE + DIRTYTILE - 1, ty * DIRTYTILE + DIRTYTILE - 1 );
+	}
+	a_Screen->Restore( WornSpan, this );
+}
 
-		if ((x >= 0) && (x < SCRWIDTH) && (y >= 0) && (y < SCRHEIGHT))
-			m_Backdrop->GetBuffer()[(int)x + (int)y * SCRWIDTH] = SubBlend( m_Backdrop->GetBuffer()[(int)x + (int)y * SCRWIDTH], 0x030303 ); // tracks
+// Game::DrawTanks - draw the tanks: the sprites through the sprite batch,
+// then the barrels of the live tanks on top
+void Game::DrawTanks()
+{
+	m_Batch.Begin( m_Surface );
+	m_Army.smoke.Draw( m_Batch, m_Smoke, m_Config.smoke ); // additive, so drawing it after bullets and mountains is fine
+	for ( unsigned int i = 0; i < m_Army.count; i++ )
+	{
+		const int flags = m_Army.flags[i];
+		float x = m_Army.pos[i].x, y = m_Army.pos[i].y;
+
+		if (!(flags & TankArmy::ACTIVE)) 
+			m_Batch.Add( m_PXSprite, 0, (int)x - 4, (int)y - 4 ); // dead tank
+		else if (flags & TankArmy::P1) // blue tank
+			m_Batch.Add( m_P1Sprite, 0, (int)x - 4, (int)y - 4 );
+		else // red tank
+			m_Batch.Add( m_P2Sprite, 0, (int)x - 4, (int)y - 4 );
+
+		if ((x >= 0) && (x < SCRWIDTH) && (y >= 0) && (y < SCRHEIGHT)) m_Tracks.Add( (int)x, (int)y );
+	}
+	m_Batch.Draw();
+
+	for ( unsigned int i = 0; i < m_Army.count; i++ ) if (m_Army.flags[i] & TankArmy::ACTIVE)
+	{
+		const float2 pos = m_Army.pos[i], dir = m_Army.dir[i];
+		m_Surface->Line( pos.x, pos.y, pos.x + 8 * dir.x, pos.y + 8 * dir.y, (m_Army.flags[i] & TankArmy::P1) ? 0x4444ff : 0xff4444 );
 	}
 }
 
-// Game::PlayerInput - handle player input
+// Game::PlayerInput - handle player input; part of the simulation, so a
+// replayed input stream steers the tanks the same way with or without drawing
 void Game::PlayerInput()
 {
-#ifndef DEV
 	if (m_LButton)
 	{
 		// start line
 		if (!m_PrevButton)
 			m_DStartX = m_MouseX, m_DStartY = m_MouseY, m_DFrames = 0; 
-		m_Surface->ThickLine( m_DStartX, m_DStartY, m_MouseX, m_MouseY, 0xffffff );
 		m_DFrames++;
 	}
 	else
 	{
 		// new target location
 		if ((m_PrevButton) && (m_DFrames < 15))
-			for ( unsigned int i = 0; i < MAXP1; i++ ) m_Tank[i]->target = float2( (float)m_MouseX, (float)m_MouseY );
+			for ( unsigned int i = 0; i < m_Config.p1; i++ ) m_Army.target[i] = float2( (float)m_MouseX, (float)m_MouseY );
+	}
+	m_PrevButton = m_LButton;	
+}
 
+// Game::DrawInput - draw the dragged line or the cross hair
+void Game::DrawInput()
+{
+	if (m_LButton)
+		m_Surface->ThickLine( m_DStartX, m_DStartY, m_MouseX, m_MouseY, 0xffffff );
+	else
+	{
 		m_Surface->Line( 0, (float)m_MouseY, SCRWIDTH - 1, (float)m_MouseY, 0xffffff );
 		m_Surface->Line( (float)m_MouseX, 0, (float)m_MouseX, SCRHEIGHT - 1, 0xffffff );
 	}
-	m_PrevButton = m_LButton;	
-#endif
+}
+
+// input file: InputHeader, then InputStream::Event entries
+#define INPUTMAGIC		0x4e49544b	// "KTIN"
+#define INPUTVERSION	2
+struct InputHeader { unsigned int magic, version, ticks, events; };
+
+// InputStream::Record - log input changes until Stop, which writes a_File
+void InputStream::Record( const char* a_File )
+{
+	Stop();
+	file = new char[strlen( a_File ) + 1];
+	strcpy( file, a_File );
+	mode = RECORD, tick = next = 0;
+	events.clear();
+}
+
+// InputStream::Replay - load a recording
+bool InputStream::Replay( const char* a_File )
+{
+	Stop();
+	FILE* f = fopen( a_File, "rb" );
+	if (!f) return false;
+	InputHeader header;
+	bool ok = (fread( &header, sizeof( header ), 1, f ) == 1) && (header.magic == INPUTMAGIC) && (header.version == INPUTVERSION);
+	if (ok)
+	{
+		events.resize( header.events );
+		ok = !header.events || (fread( &events[0], sizeof( Event ), header.events, f ) == header.events);
+	}
+	fclose( f );
+	if (!ok) return false;
+	mode = REPLAY, tick = next = 0;
+	current = live;
+	return true;
+}
+
+// InputStream::Stop - back to live input, writing the log if recording
+void InputStream::Stop()
+{
+	if (mode == RECORD)
+	{
+		FILE* f = fopen( file, "wb" );
+		if (f)
+		{
+			InputHeader header = { INPUTMAGIC, INPUTVERSION, tick, (unsigned int)events.size() };
+			fwrite( &header, sizeof( header ), 1, f );
+			if (events.size()) fwrite( &events[0], sizeof( Event ), events.size(), f );
+			fclose( f );
+		}
+	}
+	delete[] file;
+	file = 0;
+	mode = LIVE;
+}
+
+// InputStream::Next - the input for the next tick
+InputStream::State InputStream::Next()
+{
+	if (mode == REPLAY)
+	{
+		while ((next < events.size()) && (events[next].tick <= tick)) current = events[next++].state;
+	}
+	else
+	{
+		if ((mode == RECORD) && (!tick || memcmp( &live, &current, sizeof( State ) )))
+		{
+			Event e = { tick, live };
+			events.push_back( e );
+		}
+		current = live;
+	}
+	tick++;
+	return current;
 }
 
 void Tmpl8::Game::KeyDown(int a_Key)
@@ -557,92 +1445,260 @@ void Tmpl8::Game::KeyDown(int a_Key)
 
 void Tmpl8::Game::KeyUp(int a_Key)
 {
-	if (a_Key == 22)
+	if (a_Key == 19) // P: profiler overlay
+		Profiler::ToggleOverlay();
+	else if (a_Key == 9) // F: fast-forward
+		m_Uncapped = !m_Uncapped, m_TickDebt = 0;
+	else if (a_Key == 23) // T: trace the next frames to trace.json
+		Profiler::StartTrace( "trace.json", PROFILETRACE );
+	else if (a_Key == 22)
 		SaveState();
 	else if (a_Key == 15)
-		Init(true);
+		LoadState();
 }
 
-void Game::SaveState()
+// save.state: a StateHeader followed by raw arrays, in the order SaveState
+// writes them, each padded to a multiple of 4 bytes. The grids are stored as
+// per-cell counts plus the tank indices in cell order (tank grid, then team
+// grid 0 and 1), so a loaded game continues exactly like the saved one.
+#define STATEMAGIC		0x5453544b	// "KTST"
+#define STATEVERSION	4
+struct StateHeader
 {
-	ofstream saveFile("save.state", ios::trunc);
+	unsigned int magic, version;
+	unsigned int tanks, bullets, smoke;
+	unsigned int p1, p2;		// army sizes; the blue tanks come first
+	int aliveP1, aliveP2;
+	int gridW, gridH;			// grid size without the guard ring
+	unsigned int gridEntries;	// indices in all three grids
+};
 
-	saveFile << (MAXP1 + MAXP2) << "\n";
+static inline size_t Padded( size_t a_Size ) { return (a_Size + 3) & ~(size_t)3; }
 
-	if (MAXP1 > 0)
-	{
-		Tank* t = m_Tank[0];
-		saveFile << t->target.x << DELIMITER << t->target.y << "\n";
+static void WritePadded( FILE* a_File, const void* a_Data, size_t a_Size )
+{
+	static const unsigned char zero[4] = { 0, 0, 0, 0 };
+	if (a_Size) fwrite( a_Data, 1, a_Size, a_File );
+	fwrite( zero, 1, Padded( a_Size ) - a_Size, a_File );
+}
 
-		for (unsigned int i = 0; i < MAXP1; i++)
-		{
-			Tank* t = m_Tank[i];
+static const unsigned char* ReadPadded( const unsigned char* a_Src, void* a_Data, size_t a_Size )
+{
+	if (a_Size) memcpy( a_Data, a_Src, a_Size );
+	return a_Src + Padded( a_Size );
+}
 
-			saveFile << t->flags << DELIMITER;
-			saveFile << t->pos.x << DELIMITER << t->pos.y << DELIMITER;
-			saveFile << t->dir.x << DELIMITER << t->dir.y;
-			saveFile << "\n";
-		}
+// Game::SaveState - write the complete simulation state to save.state
+void Game::SaveState()
+{
+	const unsigned int n = m_Army.count, cells = gridW * gridH; // without the guard ring
+	vector<unsigned int> counts( 3 * cells ), entries;
+	entries.reserve( 2 * n );
+	for ( unsigned int g = 0; g < 3; g++ ) for ( unsigned int c = 0; c < cells; c++ )
+	{
+		const int x = c % gridW, y = c / gridW;
+		for ( GridRun run = g ? TeamCell( g - 1, x, y ) : TankCell( x, y ); run.count; run.Advance() )
+			counts[g * cells + c] += run.count, entries.insert( entries.end(), run.index, run.index + run.count );
 	}
+	StateHeader header;
+	header.magic = STATEMAGIC, header.version = STATEVERSION;
+	header.tanks = n, header.bullets = bullets.count, header.smoke = m_Army.smoke.count;
+	header.p1 = m_Config.p1, header.p2 = m_Config.p2;
+	header.aliveP1 = aliveP1, header.aliveP2 = aliveP2;
+	header.gridW = gridW, header.gridH = gridH, header.gridEntries = (unsigned int)entries.size();
+
+	FILE* f = fopen( "save.state", "wb" );
+	if (!f) return;
+	WritePadded( f, &header, sizeof( header ) );
+	WritePadded( f, m_Army.pos, n * sizeof( float2 ) );
+	WritePadded( f, m_Army.dir, n * sizeof( float2 ) );
+	WritePadded( f, m_Army.target, n * sizeof( float2 ) );
+	WritePadded( f, m_Army.maxspeed, n * sizeof( float ) );
+	WritePadded( f, m_Army.flags, n * sizeof( int ) );
+	WritePadded( f, m_Army.reloading, n * sizeof( int ) );
+	WritePadded( f, m_Army.smokeIdx, n * sizeof( int ) );
+	WritePadded( f, m_Army.inGrid, n );
+	const SmokeSystem& smoke = m_Army.smoke;
+	WritePadded( f, smoke.x, header.smoke * sizeof( int ) );
+	WritePadded( f, smoke.y, header.smoke * sizeof( int ) );
+	WritePadded( f, smoke.age, header.smoke * sizeof( int ) );
+	WritePadded( f, smoke.moved, header.smoke );
+	WritePadded( f, smoke.px, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	WritePadded( f, smoke.py, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	WritePadded( f, smoke.vy, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	WritePadded( f, smoke.life, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	WritePadded( f, bullets.px, bullets.count * sizeof( float ) );
+	WritePadded( f, bullets.py, bullets.count * sizeof( float ) );
+	WritePadded( f, bullets.vx, bullets.count * sizeof( float ) );
+	WritePadded( f, bullets.vy, bullets.count * sizeof( float ) );
+	WritePadded( f, bullets.flags, bullets.count * sizeof( int ) );
+	WritePadded( f, &counts[0], counts.size() * sizeof( unsigned int ) );
+	WritePadded( f, entries.size() ? &entries[0] : 0, entries.size() * sizeof( unsigned int ) );
+	fclose( f );
+}
 
-	saveFile << "-\n";
-
-	if (MAXP2 <= 0)
+// Game::LoadState - map save.state and copy it into the game; leaves the game
+// untouched and returns false if the file is missing, stale or truncated
+bool Game::LoadState()
+{
+	MappedFile file( "save.state" );
+	const unsigned char* src = file.GetData();
+	StateHeader header;
+	if (!src || (file.GetSize() < sizeof( header ))) return false;
+	src = ReadPadded( src, &header, sizeof( header ) );
+	const size_t n = header.tanks, cells = gridW * gridH;
+	if ((header.magic != STATEMAGIC) || (header.version != STATEVERSION) || (header.gridW != gridW) || (header.gridH != gridH)) return false;
+	if ((size_t)header.p1 + header.p2 != n) return false;
+	const size_t size = Padded( sizeof( header ) ) + 3 * Padded( n * sizeof( float2 ) ) + 4 * Padded( n * sizeof( int ) ) + Padded( n ) +
+		3 * Padded( header.smoke * sizeof( int ) ) + Padded( header.smoke ) + 4 * Padded( header.smoke * SmokeSystem::PUFFS * sizeof( int ) ) + 5 * Padded( header.bullets * sizeof( float ) ) + (3 * cells + header.gridEntries) * sizeof( unsigned int );
+	if (file.GetSize() < size) return false;
+	// the grids come last; check them before anything is loaded, so a
+	// corrupt file leaves the running game alone
+	const unsigned int* count = (const unsigned int*)(file.GetData() + size) - (3 * cells + header.gridEntries), *entry = count + 3 * cells;
+	size_t entries = 0;
+	for ( size_t c = 0; c < 3 * cells; c++ ) entries += count[c];
+	if (entries != header.gridEntries) return false;
+	for ( size_t e = 0; e < entries; e++ ) if (entry[e] >= n) return false;
+
+	m_Army.Init( header.tanks );
+	m_Config.p1 = header.p1, m_Config.p2 = header.p2; // PlayerInput steers the first p1 tanks
+	src = ReadPadded( src, m_Army.pos, n * sizeof( float2 ) );
+	src = ReadPadded( src, m_Army.dir, n * sizeof( float2 ) );
+	src = ReadPadded( src, m_Army.target, n * sizeof( float2 ) );
+	src = ReadPadded( src, m_Army.maxspeed, n * sizeof( float ) );
+	src = ReadPadded( src, m_Army.flags, n * sizeof( int ) );
+	src = ReadPadded( src, m_Army.reloading, n * sizeof( int ) );
+	src = ReadPadded( src, m_Army.smokeIdx, n * sizeof( int ) );
+	src = ReadPadded( src, m_Army.inGrid, n );
+	SmokeSystem& smoke = m_Army.smoke;
+	smoke.Resize( header.smoke );
+	src = ReadPadded( src, smoke.x, header.smoke * sizeof( int ) );
+	src = ReadPadded( src, smoke.y, header.smoke * sizeof( int ) );
+	src = ReadPadded( src, smoke.age, header.smoke * sizeof( int ) );
+	src = ReadPadded( src, smoke.moved, header.smoke );
+	src = ReadPadded( src, smoke.px, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	src = ReadPadded( src, smoke.py, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	src = ReadPadded( src, smoke.vy, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	src = ReadPadded( src, smoke.life, header.smoke * SmokeSystem::PUFFS * sizeof( int ) );
+	bullets.Init( max( header.bullets, m_Config.bullets ) );
+	bullets.count = header.bullets;
+	src = ReadPadded( src, bullets.px, header.bullets * sizeof( float ) );
+	src = ReadPadded( src, bullets.py, header.bullets * sizeof( float ) );
+	src = ReadPadded( src, bullets.vx, header.bullets * sizeof( float ) );
+	src = ReadPadded( src, bullets.vy, header.bullets * sizeof( float ) );
+	src = ReadPadded( src, bullets.flags, header.bullets * sizeof( int ) );
+	aliveP1 = header.aliveP1;
+	aliveP2 = header.aliveP2;
+
+	// refill the grids cell by cell in the saved order
+	ClearGrids();
+#ifdef SORTEDGRID
+	RebuildGrids();
+#else
+	for ( int g = 0; g < 3; g++ ) for ( int y = 0; y < gridH; y++ ) for ( int x = 0; x < gridW; x++, count++ )
 	{
-		saveFile.close();
-		return;
+		GridCell& cell = g ? teamGrid[g - 1][Cell( x, y )] : tankGrid[Cell( x, y )];
+		for ( unsigned int k = 0; k < *count; k++ ) cell.add( *entry++ );
 	}
+#endif
+	return true;
+}
 
-	Tank* t2 = m_Tank[MAXP1];
-	saveFile << t2->target.x << DELIMITER << t2->target.y << "\n";
+// Game::Tick - main game loop; without rendering only the simulation runs
+void Game::Tick( float a_DT )
+{
+	const InputStream::State input = m_Input.Next();
+	m_MouseX = input.x, m_MouseY = input.y, m_LButton = input.button != 0;
+
+	Timer timer;
+	if (m_Render)
+	{
+		PROFILE( ZONE_BACKDROP );
+		m_Tracks.Restore( m_Surface );
+	}
+	m_PhaseTime[PHASE_DRAW] += timer.elapsed();
 
-	for (unsigned int i = MAXP1; i < MAXP1 + MAXP2; i++)
+	timer.reset();
 	{
-		Tank* t = m_Tank[i];
+		PROFILE( ZONE_TANKS );
+		UpdateTanks();
+	}
+	m_PhaseTime[PHASE_TANKS] += timer.elapsed();
 
-		saveFile << t->flags << DELIMITER;
-		saveFile << t->pos.x << DELIMITER << t->pos.y << DELIMITER;
-		saveFile << t->dir.x << DELIMITER << t->dir.y;
-		saveFile << "\n";
+	timer.reset();
+	{
+		PROFILE( ZONE_BULLETS );
+		UpdateBullets();
+		PlayerInput();
 	}
+	m_PhaseTime[PHASE_BULLETS] += timer.elapsed();
 
-	saveFile.close();
+	timer.reset();
+	if (m_Render) Draw();
+	memset(mountainCircle, false, 16 * 64);
+	m_PhaseTime[PHASE_DRAW] += timer.elapsed();
 }
 
-// Game::Tick - main game loop
-void Game::Tick( float a_DT )
+// Game::Frame - advance the battle by a_Seconds of wall-clock time in fixed
+// ticks of 1 / tickRate seconds and draw only the last of them. Per frame at
+// most MAXFRAMETICKS ticks run and the rest of the debt is dropped, so under
+// load the battle slows down instead of never catching up. Uncapped, the
+// frame ticks for FASTFORWARD ms regardless of a_Seconds and draws once.
+// Tracks are laid per drawn tick, so skipped ticks leave sparser tracks.
+void Game::Frame( float a_Seconds )
 {
-	POINT p;
-	GetCursorPos( &p );
-	ScreenToClient( FindWindow( NULL, "Template" ), &p );
-	m_LButton = (GetAsyncKeyState(VK_LBUTTON) != 0);
-	m_MouseX = p.x;
-	m_MouseY = p.y;
-	m_Backdrop->CopyTo( m_Surface, 0, 0 );
-
-	for ( unsigned int i = 0; i < (MAXP1 + MAXP2); i++ ) 
-		m_Tank[i]->Tick();
-
-	for ( unsigned int i = 0; i < MAXBULLET; i++ ) 
-		bullet[i].Tick();
+	const bool render = m_Render;
+	m_Render = false;
+	if (m_Uncapped)
+	{
+		for ( Timer timer; timer.elapsed() < FASTFORWARD; ) Tick( 0 );
+		m_Render = render;
+		Tick( 0 );
+	}
+	else
+	{
+		const float tickTime = 1.0f / m_Config.tickRate;
+		m_TickDebt += a_Seconds * m_Config.tickRate;
+		int ticks = (int)m_TickDebt;
+		if (ticks > MAXFRAMETICKS) ticks = MAXFRAMETICKS, m_TickDebt = (float)ticks;
+		m_TickDebt -= (float)ticks;
+		for ( int i = 0; i < ticks; i++ )
+		{
+			m_Render = render && (i == ticks - 1);
+			Tick( tickTime );
+		}
+		m_Render = render;
+	}
+	// profiler frames are drawn frames, however many ticks they took
+	if (Profiler::enabled) Profiler::EndFrame();
+}
 
-	for(int i =0; i < 16; i++)
-		for(int r = 0; r < 64; r++)
-			if(mountainCircle[i][r])
-				for (int j = 0; j < 720; j++)
-				{
-					float x = peakx[i] + r * sinTable[j];
-					float y = peaky[i] + r * cosTable[j];
-					game->m_Surface->AddPlot((int)x, (int)y, 0x000500 * (mountainCircle[i][r]));
-				}
-	memset(mountainCircle, false, 16 * 64);
-	DrawTanks();
-	PlayerInput();
+// Game::Draw - mountain rings, tanks and the status line
+void Game::Draw()
+{
+	{
+		PROFILE( ZONE_MOUNTAINS );
+		for(int i =0; i < 16; i++)
+			for(int r = 0; r < 64; r++)
+				if(mountainCircle[i][r])
+					DrawRing( m_Surface, (int)peakx[i], (int)peaky[i], r, min( 255, 5 * mountainCircle[i][r] ) << 8 );
+	}
+	{
+		PROFILE( ZONE_DRAWTANKS );
+		DrawTanks();
+	}
+	DrawInput();
+	if (Profiler::overlay) Profiler::Draw( m_Surface, SCRWIDTH - 266, 10 );
 
 	char buffer[128];
 
 	if ((aliveP1 > 0) && (aliveP2 > 0))
 	{
+		if (m_Uncapped)
+		{
+			strcpy( buffer, "fast forward" );
+			m_Surface->Print( buffer, 10, 20, 0xffff00 );
+		}
 		sprintf( buffer, "blue army: %03i  red army: %03i", aliveP1, aliveP2 );
 		return m_Surface->Print( buffer, 10, 10, 0xffff00 );
 	}
@@ -656,4 +1712,28 @@ void Game::Tick( float a_DT )
 	sprintf( buffer, "nice, you win! blue left: %i", aliveP1 );
 
 	m_Surface->Print( buffer, 200, 370, 0xffff00 );
-}
\ No newline at end of file
+}
+
+// Game::Checksum - FNV-1a hash of the simulation state: tanks, bullets and
+// the alive counters; equal for equal runs, whatever the thread count
+static unsigned long long Hash( unsigned long long a_Hash, const void* a_Data, size_t a_Size )
+{
+	const unsigned char* data = (const unsigned char*)a_Data;
+	for ( size_t i = 0; i < a_Size; i++ ) a_Hash = (a_Hash ^ data[i]) * 0x100000001b3ULL;
+	return a_Hash;
+}
+
+unsigned long long Game::Checksum()
+{
+	const unsigned int n = m_Army.count;
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	h = Hash( h, m_Army.pos, n * sizeof( float2 ) );
+	h = Hash( h, m_Army.dir, n * sizeof( float2 ) );
+	h = Hash( h, m_Army.flags, n * sizeof( int ) );
+	h = Hash( h, m_Army.reloading, n * sizeof( int ) );
+	h = Hash( h, bullets.px, bullets.count * sizeof( float ) );
+	h = Hash( h, bullets.py, bullets.count * sizeof( float ) );
+	h = Hash( h, bullets.flags, bullets.count * sizeof( int ) );
+	h = Hash( h, &aliveP1, sizeof( int ) );
+	return Hash( h, &aliveP2, sizeof( int ) );
+}
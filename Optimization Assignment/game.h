@@ -3,103 +3,239 @@
 
 #define	SCRWIDTH	1024
 #define SCRHEIGHT	768
-#define GRIDSIZE	16
-#define GRIDX		2048/GRIDSIZE
-#define GRIDY		2048/GRIDSIZE
-#define GRIDXMASK	GRIDX - 1
-#define GRIDYMASK	GRIDY - 1
+#define GRIDSIZE	16				// world units per grid cell; TankArmy::gridX shifts by 4
 
 namespace Tmpl8 {
 
-#define MAXP1		500				// increase to test your optimized code
-#define MAXP2		(4 * MAXP1)	// because the player is smarter than the AI
-#define MAXBULLET	5000
-#define DELIMITER   ' '
+#define BULLETSPEED	1.5f			// distance per tick, in units of the firing tank's direction
+#define MAXFRAMETICKS	8				// Game::Frame runs at most this many ticks per drawn frame
+#define FASTFORWARD	30.0f			// milliseconds of ticking per drawn frame when uncapped
 
-class Smoke
+// battle setup, read once at startup from the command line (and optionally a
+// file with one "name value(s)" option per line); the defaults are the
+// original assignment: 500 blue tanks against 2000 red ones
+class GameConfig
 {
 public:
-	struct Puff { int x, y, vy, life; };
-	Smoke() : active( false ), frame( 0 ) {};
+	GameConfig() : p1( 500 ), p2( 4 * 500 ), bullets( 5000 ), worldX( 2048 ), worldY( 2048 ), spacing( 20 ), smoke( 4096 ), tickRate( 60 ), uncapped( 0 ) {}
+	void Parse( int argc, char** argv );
+	bool Load( const char* a_File );
+	int Set( const char* a_Name, const char* a_Value1, const char* a_Value2 );
+	unsigned int p1, p2;	// army sizes; increase to test your optimized code
+	unsigned int bullets;	// initial bullet pool size, the pool grows when full
+	int worldX, worldY;		// grid extents in world units, centered on the screen
+	float spacing;			// distance between tanks in the spawn formations
+	unsigned int smoke;		// smoke puffs drawn per frame at most
+	float tickRate;			// simulation ticks per second of wall-clock time in the game window
+	int uncapped;			// nonzero: tick as fast as possible and only draw now and then
+};
+
+// smoke of the dead tanks: one emitter per dead tank with PUFFS puffs each,
+// emitters and puffs stored as structures of arrays that grow when full.
+// Tick only simulates and records per emitter which puffs moved; Draw adds
+// those puffs to a SpriteBatch grouped by animation frame, and when more
+// than a_Budget are on screen it draws only every n-th emitter.
+class SmokeSystem
+{
+public:
+	enum { PUFFS = 8, FRAMES = 10 };
+	SmokeSystem() : count( 0 ), capacity( 0 ), x( 0 ), y( 0 ), age( 0 ), moved( 0 ), px( 0 ), py( 0 ), vy( 0 ), life( 0 ) {}
+	~SmokeSystem();
+	void Clear() { count = 0; }
+	void Resize( unsigned int a_Count );
+	unsigned int Spawn( int a_X, int a_Y );
 	void Tick();
-	Puff puff[8];
-	bool active;
-	int frame, xpos, ypos;
+	void Draw( SpriteBatch& a_Batch, Sprite* a_Sprite, unsigned int a_Budget );
+	unsigned int count, capacity;
+	int* x, *y, *age;				// per emitter: position, ticks up to 64
+	unsigned char* moved;			// per emitter: bit i set if puff i moved in the last Tick
+	int* px, *py, *vy, *life;		// per puff, emitter e owns [e * PUFFS, e * PUFFS + PUFFS)
+private:
+	std::vector<unsigned int> visible, order;
 };
 
-class Tank
+// structure-of-arrays tank storage; smoke lives in a side table used by dead tanks only
+class TankArmy
 {
 public:
 	enum { ACTIVE = 1, P1 = 2, P2 = 4 };
-	Tank() : pos( float2( 0, 0 ) ), dir( float2( 0, 0 ) ), target( float2( 0, 0 ) ), reloading( 0 ) {};
-	~Tank();
-	void Fire( unsigned int party, float2& pos, float2& dir );
-	void Tick();
-	float2 pos, dir, target;
-	float maxspeed;
-	int flags, reloading;
-	bool active = true;
-	unsigned short id;
-	Smoke smoke;
-	inline int gridX() { return ((int)pos.x + 512) >> 4; };
-	inline int gridY() { return ((int)pos.y + 640) >> 4; };
+	TankArmy() : count( 0 ), pos( 0 ), dir( 0 ), target( 0 ), maxspeed( 0 ), flags( 0 ), reloading( 0 ), inGrid( 0 ), smokeIdx( 0 ), nextPos( 0 ), fire( 0 ) {};
+	~TankArmy();
+	void Init( unsigned int a_Count );
+	void Fire( unsigned int i );
+	bool Aim( unsigned int i, const float2& a_Pos );
+	void Tick( unsigned int i, unsigned char a_Circle[16][64] );
+	void Commit( unsigned int i, float2 a_OldPos );
+	unsigned int count;
+	float2* pos, *dir, *target;
+	float* maxspeed;
+	int* flags, *reloading;
+	unsigned char* inGrid;
+	int* smokeIdx;			// emitter of a dead tank, -1 until it starts smoking
+	SmokeSystem smoke;
+	float2* nextPos;		// written by Tick, swapped with pos before Commit
+	unsigned char* fire;	// shot requested during Tick
+	inline int gridX( unsigned int i );		// grid cell of tank i, see game.cpp
+	inline int gridY( unsigned int i );
 };
 
-class Bullet
+// bullet storage: structure of arrays with the live bullets packed at the
+// front, swap-removed when destroyed; grows when full. Capacity is a multiple
+// of 4 so Tick can move the bullets in SSE groups.
+class BulletPool
 {
 public:
 	enum { ACTIVE = 1, P1 = 2, P2 = 4 };
-	Bullet() : flags( 0 ) {};
+	BulletPool() : px( 0 ), py( 0 ), vx( 0 ), vy( 0 ), flags( 0 ), capacity( 0 ), count( 0 ) {};
+	~BulletPool();
+	void Init( unsigned int a_Capacity );
+	void Spawn( unsigned int a_Party, const float2& a_Pos, const float2& a_Speed );
 	void Tick();
-	float2 pos, speed;
-	int flags;
-	inline int gridX() { return ((int)pos.x + 512) >> 4; };
-	inline int gridY() { return ((int)pos.y + 640) >> 4; };
+	int Sweep( unsigned int i, float2 a_From, float2 a_To );
+	float* px, *py, *vx, *vy;
+	int* flags;
+	unsigned int capacity, count;
+};
+
+// mouse input as the simulation sees it, one state per tick. Game::MouseMove
+// and MouseButton only set the live state; Game::Tick pulls the state for the
+// tick from here. Recording logs every change with its tick number, replaying
+// plays such a log back instead of the live state. The battle itself has no
+// randomness, so the input is all a replay needs.
+class InputStream
+{
+public:
+	enum { LIVE, RECORD, REPLAY };
+	struct State { short x, y; unsigned char button, pad; };
+	struct Event { unsigned int tick; State state; };
+	InputStream() : mode( LIVE ), tick( 0 ), next( 0 ), file( 0 ) { live.x = live.y = 0, live.button = live.pad = 0; current = live; }
+	~InputStream() { Stop(); }
+	void Record( const char* a_File );
+	bool Replay( const char* a_File );
+	void Stop();
+	State Next();
+	int mode;
+	unsigned int tick, next;
+	State live, current;
+	std::vector<Event> events;
+	char* file;
 };
 
 class Surface;
 class Surface8;
 class Sprite;
+
+// tread tracks: one wear byte per screen pixel instead of darkening the
+// backdrop in place. Each wear step darkens the pixel by 0x030303. Restore
+// refills the dirty screen tiles from the backdrop and wears them on the way,
+// so the tracks cost nothing until a tile is redrawn; tiles without any wear
+// are plain copies. The backdrop itself stays as generated.
+class TrackLayer
+{
+public:
+	enum { MAXWEAR = 85 };		// 85 steps of 3 take any channel to 0
+	TrackLayer() : wear( 0 ), worn( 0 ), changed( 0 ), backdrop( 0 ) {}
+	~TrackLayer();
+	void Init( Surface* a_Backdrop );
+	inline void Add( int x, int y )
+	{
+		unsigned char& w = wear[x + y * SCRWIDTH];
+		if (w < MAXWEAR) w++, changed[(x / DIRTYTILE) + (y / DIRTYTILE) * tilesX] = 1;
+	}
+	void Restore( Surface* a_Screen );
+	unsigned char* wear;		// SCRWIDTH * SCRHEIGHT wear steps
+	unsigned char* worn;		// per DIRTYTILE tile: has wear
+	unsigned char* changed;		// per tile: wear added since the last Restore
+	int tilesX, tilesY;
+	Surface* backdrop;
+};
+
 class Game
 {
 public:
+	enum { PHASE_TANKS, PHASE_BULLETS, PHASE_DRAW, PHASES };
+	Game() : m_Backdrop( 0 ), m_Heights( 0 ), m_Grid( 0 ), m_P1Sprite( 0 ), m_P2Sprite( 0 ), m_PXSprite( 0 ), m_Smoke( 0 ), m_MouseX( 0 ), m_MouseY( 0 ), m_DStartX( 0 ), m_DStartY( 0 ), m_DFrames( 0 ), m_LButton( false ), m_PrevButton( false ), m_Render( true ), m_Uncapped( false ), m_TickDebt( 0 )
+	{
+		for ( int i = 0; i < PHASES; i++ ) m_PhaseTime[i] = 0;
+	}
 	void SetTarget( Surface* a_Surface ) { m_Surface = a_Surface; }
-	void MouseMove( int x, int y ) { m_MouseX = x; m_MouseY = y; }
-	void MouseButton( bool b ) { m_LButton = b; }
+	void SetRender( bool a_Render ) { m_Render = a_Render; }
+	void MouseMove( int x, int y ) { m_Input.live.x = (short)x; m_Input.live.y = (short)y; }
+	void MouseButton( bool b ) { m_Input.live.button = b; }
 	void Init(bool loadState);
+	void BuildBackdrop();
+	void BakeMountains();
+	void SetPeak( int a_Idx, float a_X, float a_Y, float a_Height );
 	void UpdateTanks();
 	void UpdateBullets();
 	void DrawTanks();
 	void PlayerInput();
+	void DrawInput();
 	void KeyDown(int a_Key);
 	void KeyUp(int a_Key);
 	void SaveState();
-	void LoadState();
+	bool LoadState();
+	void SpawnArmies();
 	void Tick( float a_DT );
-	Surface* m_Surface, *m_Backdrop, *m_Heights, *m_Grid;
+	void Frame( float a_Seconds );
+	void Draw();
+	unsigned long long Checksum();
+	Surface* m_Surface, *m_Backdrop, *m_Heights, *m_Grid;	// heights (cached) and grid are only set while the backdrop is built
 	Sprite* m_P1Sprite, *m_P2Sprite, *m_PXSprite, *m_Smoke;
 	int m_ActiveP1, m_ActiveP2;
 	int m_MouseX, m_MouseY, m_DStartX, m_DStartY, m_DFrames;
 	bool m_LButton, m_PrevButton;
-	Tank** m_Tank;
+	bool m_Render;					// draw while ticking; off for headless benchmarks
+	bool m_Uncapped;				// Frame fast-forwards instead of keeping to the tick rate
+	float m_TickDebt;				// ticks the wall clock is ahead of the simulation
+	float m_PhaseTime[PHASES];		// milliseconds spent per phase of Tick, accumulated
+	TankArmy m_Army;
+	SpriteBatch m_Batch;
+	TrackLayer m_Tracks;
+	InputStream m_Input;
+	GameConfig m_Config;
+};
+
+// overflow storage for a GridCell holding more than GridCell::SLOTS tanks
+struct ALIGN( 64 ) GridBucket
+{
+	enum { SLOTS = 15 };
+	unsigned int next;			// next bucket + 1, 0 ends the chain
+	unsigned int index[SLOTS];
 };
 
-__declspec(align(64)) struct GridCell
+// grid cell: the count and the first 14 tank indices share one cache line,
+// further tanks spill into a chain of GridBuckets
+struct ALIGN( 64 ) GridCell
 {
+	enum { SLOTS = 14 };
 	unsigned int count = 0;
-	unsigned int index[63];
-	inline void add(Tank* newindex) { index[count] = reinterpret_cast<int>(newindex); count++; };
-	inline void remove(Tank* oldindex)
-	{
-		int i = 0;
-		while (index[i] != reinterpret_cast<int>(oldindex))
-			i++;
-		index[i] = index[--count];
-	};
-	inline Tank* getTank(int i)
+	unsigned int next = 0;		// first overflow bucket + 1
+	unsigned int index[SLOTS];
+	void add( unsigned int newindex );
+	void remove( unsigned int oldindex );
+	unsigned int* slot( unsigned int i );
+	static GridBucket* bucket;
+	static unsigned int bucketCapacity, freeBucket;
+};
+
+// GridRun - walks a cell as runs of contiguous tank indices:
+// for ( GridRun run( cell ); run.count; run.Advance() ) ...
+struct GridRun
+{
+	GridRun( const GridCell& a_Cell ) : index( a_Cell.index ), count( a_Cell.count < (unsigned int)GridCell::SLOTS ? a_Cell.count : (unsigned int)GridCell::SLOTS ), left( a_Cell.count ), next( a_Cell.next ) {}
+	GridRun( const unsigned int* a_Index, unsigned int a_Count ) : index( a_Index ), count( a_Count ), left( a_Count ), next( 0 ) {}
+	inline void Advance()
 	{
-		return reinterpret_cast<Tank*>(index[i]);
+		left -= count;
+		if (!left) { count = 0; return; }
+		const GridBucket& b = GridCell::bucket[next - 1];
+		index = b.index;
+		count = left < (unsigned int)GridBucket::SLOTS ? left : (unsigned int)GridBucket::SLOTS;
+		next = b.next;
 	}
+	const unsigned int* index;
+	unsigned int count, left, next;
 };
 
 }; // namespace Templ8
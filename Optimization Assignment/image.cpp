@@ -0,0 +1,345 @@
+// Built-in image decoders for Surface::LoadImage: TGA (true colour, grey and
+// colour mapped, raw or RLE) and PNG (8 bits per channel grey, grey + alpha,
+// RGB and RGBA, not interlaced) with its own inflate. Both decode straight
+// into a 64-byte aligned buffer, top row first, in the 32-bit layout that
+// FreeImage_ConvertTo32Bits produces.
+
+#include "template.h"
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Inflate (RFC 1951)
+// -----------------------------------------------------------
+
+#define FASTBITS	9	// codes up to this length decode with one table lookup
+
+// canonical Huffman code: fast[] maps the next FASTBITS input bits to
+// (length << 9) | symbol, 0 if the code is longer; longer codes are found by
+// comparing the bit-reversed input against maxCode per length
+struct Huffman
+{
+	unsigned short fast[1 << FASTBITS];
+	unsigned short firstCode[16], firstSymbol[16];
+	int maxCode[17];
+	unsigned char size[288];
+	unsigned short value[288];
+};
+
+struct BitReader
+{
+	const unsigned char* src, *end;
+	unsigned int bits;
+	int count, padding;		// bits buffered, zero bits shifted in past the end
+	// Need - buffer at least 25 bits, with zeros past the end of the input;
+	// the stream is broken if it consumes those (Overrun)
+	inline void Need()
+	{
+		while (count <= 24)
+		{
+			if (src < end) bits |= (unsigned int)*src++ << count; else padding += 8;
+			count += 8;
+		}
+	}
+	inline unsigned int Get( int n )
+	{
+		if (count < n) Need();
+		const unsigned int v = bits & ((1u << n) - 1);
+		bits >>= n, count -= n;
+		return v;
+	}
+	inline bool Overrun() const { return padding > count; }
+};
+
+static inline int Reverse16( int a_Code )
+{
+	a_Code = ((a_Code & 0xaaaa) >> 1) | ((a_Code & 0x5555) << 1);
+	a_Code = ((a_Code & 0xcccc) >> 2) | ((a_Code & 0x3333) << 2);
+	a_Code = ((a_Code & 0xf0f0) >> 4) | ((a_Code & 0x0f0f) << 4);
+	return ((a_Code & 0xff00) >> 8) | ((a_Code & 0x00ff) << 8);
+}
+
+// BuildHuffman - code from a_Count code lengths; false if over-subscribed
+static bool BuildHuffman( Huffman& h, const unsigned char* a_Length, int a_Count )
+{
+	int sizes[17] = { 0 }, nextCode[16], code = 0, k = 0;
+	memset( h.fast, 0, sizeof( h.fast ) );
+	for ( int i = 0; i < a_Count; i++ ) sizes[a_Length[i]]++;
+	sizes[0] = 0;
+	for ( int i = 1; i < 16; i++ )
+	{
+		nextCode[i] = code;
+		h.firstCode[i] = (unsigned short)code, h.firstSymbol[i] = (unsigned short)k;
+		code += sizes[i];
+		if (sizes[i] && ((code - 1) >= (1 << i))) return false;
+		h.maxCode[i] = code << (16 - i);
+		code <<= 1, k += sizes[i];
+	}
+	h.maxCode[16] = 0x10000;
+	for ( int i = 0; i < a_Count; i++ )
+	{
+		const int s = a_Length[i];
+		if (!s) continue;
+		const int c = nextCode[s] - h.firstCode[s] + h.firstSymbol[s];
+		h.size[c] = (unsigned char)s, h.value[c] = (unsigned short)i;
+		if (s <= FASTBITS)
+			for ( int j = Reverse16( nextCode[s] ) >> (16 - s); j < (1 << FASTBITS); j += 1 << s )
+				h.fast[j] = (unsigned short)((s << 9) | i);
+		nextCode[s]++;
+	}
+	return true;
+}
+
+// Decode - next symbol, -1 on a code that is not in the table
+static inline int Decode( BitReader& b, const Huffman& h )
+{
+	if (b.count < 16) b.Need();
+	const int fast = h.fast[b.bits & ((1 << FASTBITS) - 1)];
+	if (fast)
+	{
+		const int s = fast >> 9;
+		b.bits >>= s, b.count -= s;
+		return fast & 511;
+	}
+	const int k = Reverse16( b.bits & 0xffff );
+	int s = FASTBITS + 1;
+	while (k >= h.maxCode[s]) s++;
+	if (s >= 16) return -1;
+	const int c = (k >> (16 - s)) - h.firstCode[s] + h.firstSymbol[s];
+	if ((c >= 288) || (h.size[c] != s)) return -1;
+	b.bits >>= s, b.count -= s;
+	return h.value[c];
+}
+
+static const unsigned short lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Inflate - decompress a zlib stream into a_Dst; returns the number of bytes
+// written, or -1 if the stream is broken or does not fit
+static int Inflate( const unsigned char* a_Src, size_t a_Size, unsigned char* a_Dst, size_t a_Capacity )
+{
+	if ((a_Size < 2) || ((a_Src[0] & 15) != 8) || (((a_Src[0] << 8) | a_Src[1]) % 31) || (a_Src[1] & 32)) return -1;
+	BitReader b = { a_Src + 2, a_Src + a_Size, 0, 0, 0 };
+	unsigned char* dst = a_Dst, *end = a_Dst + a_Capacity;
+	Huffman* lit = new Huffman, *dist = new Huffman;
+	bool last = false, ok = true;
+	while (ok && !last)
+	{
+		last = b.Get( 1 ) != 0;
+		const int type = b.Get( 2 );
+		if (type == 0)
+		{
+			// stored block: byte aligned, length and its complement
+			b.Get( b.count & 7 );
+			const unsigned int len = b.Get( 16 ), nlen = b.Get( 16 );
+			if ((len != (~nlen & 0xffff)) || ((size_t)(end - dst) < len)) { ok = false; break; }
+			for ( unsigned int i = 0; i < len; i++ ) *dst++ = (unsigned char)b.Get( 8 );
+			continue;
+		}
+		unsigned char length[288 + 32];
+		if (type == 1)
+		{
+			memset( length, 8, 144 ), memset( length + 144, 9, 112 ), memset( length + 256, 7, 24 ), memset( length + 280, 8, 8 );
+			memset( length + 288, 5, 32 );
+			BuildHuffman( *lit, length, 288 ), BuildHuffman( *dist, length + 288, 32 );
+		}
+		else if (type == 2)
+		{
+			static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			const int hlit = b.Get( 5 ) + 257, hdist = b.Get( 5 ) + 1, hclen = b.Get( 4 ) + 4;
+			unsigned char codeLength[19] = { 0 };
+			for ( int i = 0; i < hclen; i++ ) codeLength[order[i]] = (unsigned char)b.Get( 3 );
+			Huffman* lengths = lit; // reused: the literal table is built after this
+			if (!BuildHuffman( *lengths, codeLength, 19 )) { ok = false; break; }
+			for ( int n = 0; ok && (n < hlit + hdist); )
+			{
+				const int sym = Decode( b, *lengths );
+				if (sym < 16) { if (sym < 0) ok = false; else length[n++] = (unsigned char)sym; continue; }
+				int repeat, value = 0;
+				if (sym == 16) { if (!n) { ok = false; break; } value = length[n - 1], repeat = 3 + b.Get( 2 ); }
+				else if (sym == 17) repeat = 3 + b.Get( 3 );
+				else repeat = 11 + b.Get( 7 );
+				if (n + repeat > hlit + hdist) { ok = false; break; }
+				memset( length + n, value, repeat ), n += repeat;
+			}
+			if (!ok || !BuildHuffman( *lit, length, hlit ) || !BuildHuffman( *dist, length + hlit, hdist )) { ok = false; break; }
+		}
+		else { ok = false; break; }
+		// literal / length + distance pairs up to the end of block code
+		while (true)
+		{
+			int sym = Decode( b, *lit );
+			if (sym < 256)
+			{
+				if ((sym < 0) || (dst == end)) { ok = false; break; }
+				*dst++ = (unsigned char)sym;
+				continue;
+			}
+			if (sym == 256) break;
+			sym -= 257;
+			if (sym >= 29) { ok = false; break; }
+			const int len = lengthBase[sym] + b.Get( lengthExtra[sym] );
+			const int d = Decode( b, *dist );
+			if ((d < 0) || (d >= 30)) { ok = false; break; }
+			const int distance = distBase[d] + b.Get( distExtra[d] );
+			if ((distance > dst - a_Dst) || (len > end - dst)) { ok = false; break; }
+			const unsigned char* from = dst - distance;
+			for ( int i = 0; i < len; i++ ) dst[i] = from[i]; // may overlap
+			dst += len;
+		}
+		if (b.Overrun()) ok = false;
+	}
+	delete lit;
+	delete dist;
+	return ok ? (int)(dst - a_Dst) : -1;
+}
+
+// -----------------------------------------------------------
+// PNG
+// -----------------------------------------------------------
+
+static inline unsigned int BigEndian( const unsigned char* p ) { return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static Pixel* DecodePNG( const unsigned char* a_Data, size_t a_Size, int& a_Width, int& a_Height )
+{
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+	if ((a_Size < 33) || memcmp( a_Data, signature, 8 ) || memcmp( a_Data + 12, "IHDR", 4 )) return 0;
+	const unsigned int w = BigEndian( a_Data + 16 ), h = BigEndian( a_Data + 20 );
+	const int depth = a_Data[24], type = a_Data[25], interlace = a_Data[28];
+	const int channels = (type == 0) ? 1 : (type == 2) ? 3 : (type == 4) ? 2 : (type == 6) ? 4 : 0;
+	if (!channels || (depth != 8) || interlace || !w || !h || (w > 32768) || (h > 32768)) return 0;
+	// gather the IDAT chunks into one zlib stream
+	std::vector<unsigned char> stream;
+	for ( size_t p = 8; p + 12 <= a_Size; )
+	{
+		const size_t len = BigEndian( a_Data + p );
+		if (p + 12 + len > a_Size) return 0;
+		if (!memcmp( a_Data + p + 4, "IDAT", 4 )) stream.insert( stream.end(), a_Data + p + 8, a_Data + p + 8 + len );
+		if (!memcmp( a_Data + p + 4, "IEND", 4 )) break;
+		p += 12 + len;
+	}
+	const size_t stride = w * channels, rawSize = (stride + 1) * h;
+	unsigned char* raw = (unsigned char*)MALLOC64( rawSize );
+	if (stream.empty() || (Inflate( &stream[0], stream.size(), raw, rawSize ) != (int)rawSize)) { FREE64( raw ); return 0; }
+	// undo the per-row filters in place; row y - 1 is already unfiltered and
+	// the first row filters against a row of zeros
+	std::vector<unsigned char> zero( stride, 0 );
+	for ( unsigned int y = 0; y < h; y++ )
+	{
+		unsigned char* row = raw + y * (stride + 1) + 1;
+		const unsigned char* up = y ? (row - stride - 1) : &zero[0];
+		const size_t c = channels;
+		switch (row[-1])
+		{
+		case 0: break;
+		case 1: for ( size_t x = c; x < stride; x++ ) row[x] += row[x - c]; break;
+		case 2: for ( size_t x = 0; x < stride; x++ ) row[x] += up[x]; break;
+		case 3:
+			for ( size_t x = 0; x < c; x++ ) row[x] += up[x] >> 1;
+			for ( size_t x = c; x < stride; x++ ) row[x] += (row[x - c] + up[x]) >> 1;
+			break;
+		case 4:
+			for ( size_t x = 0; x < c; x++ ) row[x] += up[x];
+			for ( size_t x = c; x < stride; x++ )
+			{
+				const int a = row[x - c], b = up[x], d = up[x - c], p = a + b - d, pa = abs( p - a ), pb = abs( p - b ), pd = abs( p - d );
+				row[x] += (unsigned char)(((pa <= pb) && (pa <= pd)) ? a : (pb <= pd) ? b : d);
+			}
+			break;
+		default: FREE64( raw ); return 0;
+		}
+	}
+	Pixel* pixels = (Pixel*)MALLOC64( w * h * sizeof( Pixel ) );
+	for ( unsigned int y = 0; y < h; y++ )
+	{
+		const unsigned char* s = raw + y * (stride + 1) + 1;
+		Pixel* d = pixels + y * w;
+		for ( unsigned int x = 0; x < w; x++, s += channels )
+		{
+			if (channels == 1) d[x] = 0xff000000 | (s[0] * 0x010101);
+			else if (channels == 2) d[x] = (s[1] << 24) | (s[0] * 0x010101);
+			else if (channels == 3) d[x] = 0xff000000 | (s[0] << 16) | (s[1] << 8) | s[2];
+			else d[x] = ((Pixel)s[3] << 24) | (s[0] << 16) | (s[1] << 8) | s[2];
+		}
+	}
+	FREE64( raw );
+	a_Width = (int)w, a_Height = (int)h;
+	return pixels;
+}
+
+// -----------------------------------------------------------
+// TGA
+// -----------------------------------------------------------
+
+// TGAColor - one stored colour value of a_Bits bits; 16-bit colours are
+// x1r5g5b5 without alpha, as FreeImage loads them
+static inline Pixel TGAColor( const unsigned char* p, int a_Bits )
+{
+	if (a_Bits == 8) return 0xff000000 | (p[0] * 0x010101);
+	if (a_Bits <= 16)
+	{
+		const unsigned int v = p[0] | (p[1] << 8);
+		return 0xff000000 | ((((v >> 10) & 31) * 255 / 31) << 16) | ((((v >> 5) & 31) * 255 / 31) << 8) | ((v & 31) * 255 / 31);
+	}
+	if (a_Bits == 24) return 0xff000000 | (p[2] << 16) | (p[1] << 8) | p[0];
+	return ((Pixel)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static Pixel* DecodeTGA( const unsigned char* a_Data, size_t a_Size, int& a_Width, int& a_Height )
+{
+	if (a_Size < 18) return 0;
+	const int idLength = a_Data[0], mapType = a_Data[1], type = a_Data[2];
+	const int mapFirst = a_Data[3] | (a_Data[4] << 8), mapLength = a_Data[5] | (a_Data[6] << 8), mapBits = a_Data[7];
+	const int w = a_Data[12] | (a_Data[13] << 8), h = a_Data[14] | (a_Data[15] << 8), bits = a_Data[16];
+	const bool topDown = (a_Data[17] & 32) != 0, rle = type >= 9, mapped = (type & 7) == 1;
+	if (((type & 7) < 1) || ((type & 7) > 3) || (type & ~11) || !w || !h) return 0;
+	if (mapped ? ((bits != 8) || (mapType != 1)) : ((type & 7) == 3) ? (bits != 8) : ((bits != 15) && (bits != 16) && (bits != 24) && (bits != 32))) return 0;
+	const int mapBytes = (mapBits + 7) / 8, bytes = (bits + 7) / 8;
+	const unsigned char* map = a_Data + 18 + idLength, *src = map + (mapType ? mapLength * mapBytes : 0), *end = a_Data + a_Size;
+	if (src > end) return 0;
+	std::vector<Pixel> palette;
+	if (mapped)
+	{
+		if ((mapBits != 15) && (mapBits != 16) && (mapBits != 24) && (mapBits != 32)) return 0;
+		palette.resize( mapFirst + mapLength, 0xff000000 );
+		for ( int i = 0; i < mapLength; i++ ) palette[mapFirst + i] = TGAColor( map + i * mapBytes, mapBits );
+		palette.resize( 256, 0xff000000 );
+	}
+	Pixel* pixels = (Pixel*)MALLOC64( w * h * sizeof( Pixel ) );
+	const int count = w * h;
+	for ( int i = 0; i < count; )
+	{
+		// a raw image is one run of all pixels; an RLE packet is a run of up
+		// to 128 stored pixels, or one pixel repeated up to 128 times
+		int n = count - i;
+		bool repeat = false;
+		if (rle)
+		{
+			if (src >= end) { FREE64( pixels ); return 0; }
+			n = min( (*src & 127) + 1, count - i ), repeat = (*src++ & 128) != 0;
+		}
+		for ( int k = 0; k < n; k++, i++ )
+		{
+			if (src + bytes > end) { FREE64( pixels ); return 0; }
+			const int y = i / w, x = i - y * w;
+			pixels[x + (topDown ? y : (h - 1 - y)) * w] = mapped ? palette[*src] : TGAColor( src, bits );
+			if (!repeat) src += bytes;
+		}
+		if (repeat) src += bytes;
+	}
+	a_Width = w, a_Height = h;
+	return pixels;
+}
+
+// DecodeImage - decode a PNG or TGA file held in memory into a new MALLOC64
+// buffer of a_Width * a_Height pixels; 0 for other or unsupported files
+Pixel* DecodeImage( const unsigned char* a_Data, size_t a_Size, int& a_Width, int& a_Height )
+{
+	if (!a_Data) return 0;
+	if ((a_Size >= 8) && (a_Data[0] == 137) && (a_Data[1] == 'P')) return DecodePNG( a_Data, a_Size, a_Width, a_Height );
+	return DecodeTGA( a_Data, a_Size, a_Width, a_Height );
+}
+
+}; // namespace Tmpl8
@@ -0,0 +1,164 @@
+// Zone profiler, see profiler.h
+
+#include "template.h"
+
+#ifdef _WIN32
+#define THREADLOCAL		__declspec(thread)
+#define ATOMICINC(x)	(_InterlockedIncrement( (volatile long*)&(x) ) - 1)
+#else
+#define THREADLOCAL		__thread
+#define ATOMICINC(x)	__sync_fetch_and_add( &(x), 1 )
+#endif
+
+namespace Tmpl8 {
+
+static const char* zoneName[ZONES] = { "backdrop", "tanks", "bullets", "mountains", "draw tanks", "present", "tank jobs", "jobs", "job wait" };
+static const Pixel zoneColor[ZONES] = { 0x808080, 0xff4040, 0xffff40, 0x40ff40, 0x4080ff, 0xff40ff, 0xffffff, 0xc0c0c0, 0x808080 };
+static THREADLOCAL int ringIndex = -1;	// ring of the calling thread, claimed on first use
+
+bool Profiler::enabled = false, Profiler::overlay = false;
+Profiler::Ring Profiler::ring[MAXJOBTHREADS + 1];
+unsigned int Profiler::rings = 0, Profiler::frame = 0;
+float Profiler::history[PROFILEFRAMES][ZONES];
+std::vector<Profiler::TraceEvent> Profiler::trace;
+char Profiler::traceFile[256];
+int Profiler::traceFrames = 0;
+Timer::value_type Profiler::frameStart = 0;
+
+// Profiler::ThreadRing - ring of the calling thread, -1 if all are taken
+int Profiler::ThreadRing()
+{
+	if (ringIndex < 0)
+	{
+		const unsigned int idx = ATOMICINC( rings );
+		if (idx > MAXJOBTHREADS) return -1;
+		ringIndex = idx;
+	}
+	return ringIndex;
+}
+
+// Profiler::Add - append a record to the calling thread's ring
+void Profiler::Add( int a_Zone, Timer::value_type a_Start, Timer::value_type a_End )
+{
+	const int idx = ThreadRing();
+	if (idx < 0) return;
+	Ring& r = ring[idx];
+	Record& rec = r.record[r.head % PROFILERING];
+	rec.zone = a_Zone, rec.start = a_Start, rec.end = a_End;
+	r.head++;
+}
+
+// Profiler::EndFrame - sum the records of all threads into the next history
+// row; called by the main thread while the job threads are idle
+void Profiler::EndFrame()
+{
+	const Timer::value_type now = Timer::get();
+	float* row = history[frame++ % PROFILEFRAMES];
+	for ( int z = 0; z < ZONES; z++ ) row[z] = 0;
+	const unsigned int count = min( rings, (unsigned int)(MAXJOBTHREADS + 1) );
+	for ( unsigned int i = 0; i < count; i++ )
+	{
+		Ring& r = ring[i];
+		if ((r.head - r.tail) > PROFILERING) r.tail = r.head - PROFILERING; // overwritten
+		for ( ; r.tail != r.head; r.tail++ )
+		{
+			const Record& rec = r.record[r.tail % PROFILERING];
+			row[rec.zone] += (float)Timer::to_time( rec.end - rec.start );
+			if (traceFrames)
+			{
+				TraceEvent e = { rec.zone, (int)i, rec.start, rec.end };
+				trace.push_back( e );
+			}
+		}
+	}
+	if (!traceFrames) return;
+	TraceEvent e = { -1, ThreadRing(), frameStart, now };
+	trace.push_back( e );
+	frameStart = now;
+	if (--traceFrames) return;
+	WriteTrace();
+	enabled = overlay;
+}
+
+// Profiler::ToggleOverlay - show or hide the overlay; records are kept while
+// the overlay is shown or a trace is running
+void Profiler::ToggleOverlay()
+{
+	overlay = !overlay;
+	enabled = overlay || (traceFrames > 0);
+}
+
+// Profiler::StartTrace - record the next a_Frames frames into a_File; called
+// between frames, so the first frame starts here
+void Profiler::StartTrace( const char* a_File, int a_Frames )
+{
+	strncpy( traceFile, a_File, sizeof( traceFile ) - 1 );
+	traceFile[sizeof( traceFile ) - 1] = 0;
+	trace.clear();
+	trace.reserve( a_Frames * 64 );
+	traceFrames = max( a_Frames, 1 );
+	frameStart = Timer::get();
+	enabled = true;
+	// drop what the rings hold from before the trace
+	for ( unsigned int i = 0; i < min( rings, (unsigned int)(MAXJOBTHREADS + 1) ); i++ ) ring[i].tail = ring[i].head;
+}
+
+// Profiler::WriteTrace - chrome://tracing JSON: one complete event per record,
+// times in microseconds from the start of the trace, one row per thread
+void Profiler::WriteTrace()
+{
+	FILE* f = fopen( traceFile, "w" );
+	if (!f) return;
+	Timer::value_type first = trace.size() ? trace[0].start : 0;
+	for ( size_t i = 0; i < trace.size(); i++ ) if (trace[i].start < first) first = trace[i].start;
+	fprintf( f, "{\"traceEvents\":[\n" );
+	const int mainRing = ThreadRing();
+	for ( unsigned int i = 0; i < min( rings, (unsigned int)(MAXJOBTHREADS + 1) ); i++ )
+		fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}},\n", i, ((int)i == mainRing) ? "main" : "thread", i );
+	unsigned int frameNr = 0;
+	for ( size_t i = 0; i < trace.size(); i++ )
+	{
+		const TraceEvent& e = trace[i];
+		char name[32];
+		if (e.zone < 0) sprintf( name, "frame %u", frameNr++ ); else strcpy( name, zoneName[e.zone] );
+		fprintf( f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}%s\n", name, e.thread,
+			Timer::to_time( e.start - first ) * 1000, Timer::to_time( e.end - e.start ) * 1000, (i + 1 < trace.size()) ? "," : "" );
+	}
+	fprintf( f, "]}\n" );
+	fclose( f );
+	trace.clear();
+}
+
+// Profiler::Draw - one column per frame, main thread zones stacked at 4 pixels
+// per millisecond, with the average over the history per zone as a legend
+void Profiler::Draw( Surface* a_Surface, int a_X, int a_Y )
+{
+	const int height = 100;
+	a_Surface->Bar( a_X - 2, a_Y - 2, a_X + PROFILEFRAMES * 2 + 1, a_Y + height + 2 + ZONES * 8, 0x000000 );
+	a_Surface->Box( a_X - 2, a_Y - 2, a_X + PROFILEFRAMES * 2 + 1, a_Y + height + 2 + ZONES * 8, 0x404040 );
+	float average[ZONES] = { 0 };
+	const unsigned int frames = min( frame, (unsigned int)PROFILEFRAMES );
+	for ( unsigned int f = 0; f < frames; f++ )
+	{
+		// oldest frame on the left
+		const float* row = history[(frame - frames + f) % PROFILEFRAMES];
+		int y = a_Y + height;
+		for ( int z = 0; z < ZONES; z++ )
+		{
+			average[z] += row[z] / frames;
+			if (z > ZONE_PRESENT) continue;
+			const int h = min( (int)(row[z] * 4), y - a_Y );
+			if (h > 0) a_Surface->Bar( a_X + f * 2, y - h, a_X + f * 2 + 1, y - 1, zoneColor[z] );
+			y -= h;
+		}
+	}
+	for ( int z = 0; z < ZONES; z++ )
+	{
+		char line[64];
+		sprintf( line, "%-10s %6.2f ms", zoneName[z], average[z] );
+		a_Surface->Bar( a_X, a_Y + height + 4 + z * 8, a_X + 4, a_Y + height + 8 + z * 8, zoneColor[z] );
+		a_Surface->Print( line, a_X + 8, a_Y + height + 4 + z * 8, 0xffffff );
+	}
+}
+
+}; // namespace Tmpl8
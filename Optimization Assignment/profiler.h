@@ -0,0 +1,62 @@
+// Zone profiler: PROFILE( ZONE_x ) times the rest of the enclosing scope.
+// Every thread appends its records to its own ring buffer, so scopes never
+// lock or allocate. Profiler::EndFrame folds the rings into per-frame zone
+// totals, Profiler::Draw shows the recent frames as stacked bars. While a
+// trace is running, EndFrame also keeps every record, and after the last
+// frame writes them as a chrome://tracing JSON timeline.
+
+#pragma once
+
+namespace Tmpl8 {
+
+// zones up to ZONE_PRESENT run on the main thread and are stacked in the
+// overlay; the others overlap them (job spans on the job threads, the main
+// thread waiting for jobs) and are shown as totals
+enum
+{
+	ZONE_BACKDROP, ZONE_TANKS, ZONE_BULLETS, ZONE_MOUNTAINS, ZONE_DRAWTANKS, ZONE_PRESENT,
+	ZONE_TANKJOB, ZONE_JOB, ZONE_JOBWAIT, ZONES
+};
+
+#define PROFILERING		1024	// records per thread between two EndFrame calls
+#define PROFILEFRAMES	128		// frames of history in the overlay
+#define PROFILETRACE	120		// frames in a trace started with the T key
+
+class Profiler
+{
+public:
+	struct Record { int zone; Timer::value_type start, end; };
+	struct Ring { Record record[PROFILERING]; unsigned int head, tail; };
+	static void Add( int a_Zone, Timer::value_type a_Start, Timer::value_type a_End );
+	static void EndFrame();
+	static void Draw( Surface* a_Surface, int a_X, int a_Y );
+	static void ToggleOverlay();
+	static void StartTrace( const char* a_File, int a_Frames );
+	static bool enabled, overlay;	// recording (overlay or trace), overlay shown
+private:
+	struct TraceEvent { int zone, thread; Timer::value_type start, end; };	// zone -1: frame
+	static int ThreadRing();
+	static void WriteTrace();
+	static Ring ring[MAXJOBTHREADS + 1];
+	static unsigned int rings, frame;
+	static float history[PROFILEFRAMES][ZONES];	// milliseconds per zone per frame
+	static std::vector<TraceEvent> trace;
+	static char traceFile[256];
+	static int traceFrames;							// frames left in the running trace
+	static Timer::value_type frameStart;
+};
+
+// ProfileScope - adds a record for its zone when it goes out of scope
+class ProfileScope
+{
+public:
+	ProfileScope( int a_Zone ) : zone( a_Zone ), start( Profiler::enabled ? Timer::get() : 0 ) {}
+	~ProfileScope() { if (start) Profiler::Add( zone, start, Timer::get() ); }
+private:
+	int zone;
+	Timer::value_type start;
+};
+
+#define PROFILE(zone)	ProfileScope profileScope( zone )
+
+}; // namespace Tmpl8
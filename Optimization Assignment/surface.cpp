@@ -15,21 +15,24 @@ Surface::Surface( int a_Width, int a_Height, Pixel* a_Buffer, int a_Pitch ) :
 	m_Buffer( a_Buffer ),
 	m_Width( a_Width ),
 	m_Height( a_Height ),
-	m_Pitch( a_Pitch )
+	m_Pitch( a_Pitch ),
+	m_Dirty( 0 )
 {
 }
 
 Surface::Surface( int a_Width, int a_Height ) :
 	m_Width( a_Width ),
 	m_Height( a_Height ),
-	m_Pitch( a_Width )
+	m_Pitch( a_Width ),
+	m_Dirty( 0 )
 {
 	m_Buffer = (Pixel*)MALLOC64( a_Width * a_Height * sizeof( Pixel ) );
 }
 
 Surface::Surface( char* a_File ) :
 	m_Buffer( NULL ),
-	m_Width( 0 ), m_Height( 0 )
+	m_Width( 0 ), m_Height( 0 ),
+	m_Dirty( 0 )
 {
 	FILE* f = fopen( a_File, "rb" );
 	if (!f) 
@@ -43,34 +46,130 @@ Surface::Surface( char* a_File ) :
 	LoadImage( a_File );
 }
 
+// Surface::LoadImage - decode with the built-in TGA / PNG loader, falling
+// back to FreeImage for other files unless built with NOFREEIMAGE
 void Surface::LoadImage( char* a_File )
 {
-	FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
-	fif = FreeImage_GetFileType( a_File, 0 );
-	if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename( a_File );
-	FIBITMAP* tmp = FreeImage_Load( fif, a_File );
-	FIBITMAP* dib = FreeImage_ConvertTo32Bits( tmp );
-	FreeImage_Unload( tmp );
-	m_Width = m_Pitch = FreeImage_GetWidth( dib );
-	m_Height = FreeImage_GetHeight( dib );
-	m_Buffer = (Pixel*)MALLOC64( m_Width * m_Height * sizeof( Pixel ) );
-	for( int y = 0; y < m_Height; y++) 
 	{
-		unsigned char* line = FreeImage_GetScanLine( dib, m_Height - 1 - y );
-		memcpy( m_Buffer + y * m_Pitch, line, m_Width * sizeof( Pixel ) );
+		MappedFile file( a_File );
+		m_Buffer = DecodeImage( file.GetData(), file.GetSize(), m_Width, m_Height );
 	}
-	FreeImage_Unload( dib );
+#ifndef NOFREEIMAGE
+	if (!m_Buffer)
+	{
+		FREE_IMAGE_FORMAT fif = FIF_UNKNOWN;
+		fif = FreeImage_GetFileType( a_File, 0 );
+		if (fif == FIF_UNKNOWN) fif = FreeImage_GetFIFFromFilename( a_File );
+		FIBITMAP* tmp = FreeImage_Load( fif, a_File );
+		FIBITMAP* dib = FreeImage_ConvertTo32Bits( tmp );
+		FreeImage_Unload( tmp );
+		m_Width = FreeImage_GetWidth( dib );
+		m_Height = FreeImage_GetHeight( dib );
+		m_Buffer = (Pixel*)MALLOC64( m_Width * m_Height * sizeof( Pixel ) );
+		for( int y = 0; y < m_Height; y++) 
+		{
+			unsigned char* line = FreeImage_GetScanLine( dib, m_Height - 1 - y );
+			memcpy( m_Buffer + y * m_Width, line, m_Width * sizeof( Pixel ) );
+		}
+		FreeImage_Unload( dib );
+	}
+#endif
+	if (!m_Buffer) { m_Width = m_Height = 0; return; }
+	m_Pitch = m_Width;
+}
+
+// decoded images by file name, kept for the lifetime of the process
+struct CachedImage { char* file; Surface* surface; };
+static struct ImageCache : std::vector<CachedImage>
+{
+	~ImageCache() { for ( size_t i = 0; i < size(); i++ ) delete[] (*this)[i].file, delete (*this)[i].surface; }
+} cachedImages;
+
+// Surface::Asset - decode a file on first use and hand out the same surface
+// afterwards, without copying it; the cache owns it, so callers do not delete it
+Surface* Surface::Asset( char* a_File )
+{
+	for ( size_t i = 0; i < cachedImages.size(); i++ ) if (!strcmp( cachedImages[i].file, a_File )) return cachedImages[i].surface;
+	CachedImage image = { new char[strlen( a_File ) + 1], new Surface( a_File ) };
+	strcpy( image.file, a_File );
+	cachedImages.push_back( image );
+	return image.surface;
 }
 
 Surface::~Surface()
 {
 	FREE64( m_Buffer );
+	delete[] m_Dirty;
+}
+
+// Surface::TrackDirty - start tracking; the current contents count as dirty
+void Surface::TrackDirty()
+{
+	delete[] m_Dirty;
+	m_DirtyX = (m_Width + DIRTYTILE - 1) / DIRTYTILE;
+	m_DirtyY = (m_Height + DIRTYTILE - 1) / DIRTYTILE;
+	m_Dirty = new unsigned char[m_DirtyX * m_DirtyY];
+	memset( m_Dirty, 1, m_DirtyX * m_DirtyY );
+	m_DirtyCount = m_DirtyX * m_DirtyY;
+}
+
+// Surface::MarkDirty - mark the tiles overlapping a pixel rectangle
+void Surface::MarkDirty( int x1, int y1, int x2, int y2 )
+{
+	if (!m_Dirty) return;
+	x1 = max( x1, 0 ), y1 = max( y1, 0 ), x2 = min( x2, m_Width - 1 ), y2 = min( y2, m_Height - 1 );
+	if ((x2 < x1) || (y2 < y1)) return;
+	for ( int ty = y1 / DIRTYTILE; ty <= y2 / DIRTYTILE; ty++ )
+	{
+		unsigned char* tile = m_Dirty + ty * m_DirtyX;
+		for ( int tx = x1 / DIRTYTILE; tx <= x2 / DIRTYTILE; tx++ ) if (!tile[tx]) tile[tx] = 1, m_DirtyCount++;
+	}
+}
+
+// CopySpan - Surface::Restore span that copies from the backdrop surface
+static void CopySpan( void* a_Backdrop, Pixel* a_Dst, int a_X, int a_Y, int a_Width )
+{
+	Surface* backdrop = (Surface*)a_Backdrop;
+	memcpy( a_Dst, backdrop->GetBuffer() + a_X + a_Y * backdrop->GetPitch(), a_Width * sizeof( Pixel ) );
+}
+
+// Surface::Restore - copy the dirty tiles back from a_Backdrop, which has the
+// same size, and mark everything clean
+void Surface::Restore( Surface* a_Backdrop )
+{
+	Restore( CopySpan, a_Backdrop );
+}
+
+// Surface::Restore - refill the dirty tiles through a_Span and mark
+// everything clean. Runs of dirty tiles are passed as one span per pixel
+// row; past half the tiles every row is refilled whole.
+void Surface::Restore( RestoreSpan a_Span, void* a_Context )
+{
+	if (!m_Dirty || ((m_DirtyCount * 2) > (m_DirtyX * m_DirtyY)))
+	{
+		for ( int y = 0; y < m_Height; y++ ) a_Span( a_Context, m_Buffer + y * m_Pitch, 0, y, m_Width );
+	}
+	else if (m_DirtyCount) for ( int ty = 0; ty < m_DirtyY; ty++ )
+	{
+		const unsigned char* tile = m_Dirty + ty * m_DirtyX;
+		const int y1 = ty * DIRTYTILE, y2 = min( y1 + DIRTYTILE, m_Height );
+		for ( int tx = 0; tx < m_DirtyX; )
+		{
+			if (!tile[tx]) { tx++; continue; }
+			const int first = tx;
+			while ((tx < m_DirtyX) && tile[tx]) tx++;
+			const int x1 = first * DIRTYTILE, width = min( tx * DIRTYTILE, m_Width ) - x1;
+			for ( int y = y1; y < y2; y++ ) a_Span( a_Context, m_Buffer + x1 + y * m_Pitch, x1, y, width );
+		}
+	}
+	if (m_Dirty) memset( m_Dirty, 0, m_DirtyX * m_DirtyY ), m_DirtyCount = 0;
 }
 
 void Surface::Clear( Pixel a_Color )
 {
 	int s = m_Width * m_Height;
 	for ( int i = 0; i < s; i++ ) m_Buffer[i] = a_Color;
+	MarkAllDirty();
 }
 
 void Surface::Centre( char* a_String, int y1, Pixel color )
@@ -81,6 +180,7 @@ void Surface::Centre( char* a_String, int y1, Pixel color )
 
 void Surface::Print( char* a_String, int x1, int y1, Pixel color )
 {
+	MarkDirty( x1, y1, x1 + (int)strlen( a_String ) * 6, y1 + 5 );
 	Pixel* t = m_Buffer + x1 + y1 * m_Pitch;
 	int i;
 	for ( i = 0; i < (int)(strlen( a_String )); i++ )
@@ -105,6 +205,7 @@ void Surface::Resize( Surface* a_Orig )
 	Pixel* src = a_Orig->GetBuffer(), *dst = m_Buffer;
 	int u, v, owidth = a_Orig->GetWidth(), oheight = a_Orig->GetHeight();
 	int dx = (owidth << 10) / m_Width, dy = (oheight << 10) / m_Height;
+	MarkAllDirty();
 	for ( v = 0; v < m_Height; v++ )
 	{
 		for ( u = 0; u < m_Width; u++ )
@@ -134,6 +235,7 @@ void Surface::Line( float x1, float y1, float x2, float y2, Pixel c )
 	{
 		return;
 	}
+	MarkDirty( (int)min( x1, x2 ) - 1, (int)min( y1, y2 ) - 1, (int)max( x1, x2 ) + 1, (int)max( y1, y2 ) + 1 ); // stepping may drift a pixel
 	float b = x2 - x1;
 	float h = y2 - y1;
 	float l = fabsf( b );
@@ -155,6 +257,7 @@ void Surface::AddLine( float x1, float y1, float x2, float y2, Pixel c )
 	{
 		return;
 	}
+	MarkDirty( (int)min( x1, x2 ) - 1, (int)min( y1, y2 ) - 1, (int)max( x1, x2 ) + 1, (int)max( y1, y2 ) + 1 ); // stepping may drift a pixel
 	float b = x2 - x1;
 	float h = y2 - y1;
 	float l = fabsf( b );
@@ -182,17 +285,20 @@ void Surface::ThickLine( int ax1, int ay1, int ax2, int ay2, Pixel c )
 
 void Surface::Plot( int x, int y, Pixel c )
 { 
+	MarkDirty( x, y, x, y );
 	if ((x >= 0) && (y >= 0) && (x < m_Width) && (y < m_Height)) m_Buffer[x + y * m_Pitch] = c;
 }
 
 void Surface::AddPlot(int x, int y, Pixel c)
 {
+	MarkDirty( x, y, x, y );
 	if ((x >= 0) && (y >= 0) && (x < m_Width) && (y < m_Height))
 		m_Buffer[x + y * m_Pitch] = AddBlend(c, m_Buffer[x + y * m_Pitch]);
 }
 
 void Surface::MultiAddPlot(int x, int y, Pixel c, int count)
 {
+	MarkDirty( x, y, x, y );
 	if ((x >= 0) && (y >= 0) && (x < m_Width) && (y < m_Height))
 		for(int i = 0; i < count; i++)
 			m_Buffer[x + y * m_Pitch] = AddBlend(c, m_Buffer[x + y * m_Pitch]);
@@ -208,6 +314,7 @@ void Surface::Box( int x1, int y1, int x2, int y2, Pixel c )
 
 void Surface::Bar( int x1, int y1, int x2, int y2, Pixel c )
 {
+	MarkDirty( x1, y1, x2, y2 );
 	Pixel* a = x1 + y1 * m_Pitch + m_Buffer;
 	for ( int y = y1; y <= y2; y++ )
 	{
@@ -234,6 +341,7 @@ void Surface::CopyTo( Surface* a_Dst, int a_X, int a_Y )
 		if (a_Y < 0) src -= a_Y * srcpitch, srcheight += a_Y, a_Y = 0;
 		if ((srcwidth > 0) && (srcheight > 0))
 		{
+			a_Dst->MarkDirty( a_X, a_Y, a_X + srcwidth - 1, a_Y + srcheight - 1 );
 			dst += a_X + dstpitch * a_Y;
 			for ( int y = 0; y < srcheight; y++ )
 			{
@@ -263,6 +371,7 @@ void Surface::BlendCopyTo( Surface* a_Dst, int a_X, int a_Y )
 		if (a_Y < 0) src -= a_Y * srcpitch, srcheight += a_Y, a_Y = 0;
 		if ((srcwidth > 0) && (srcheight > 0))
 		{
+			a_Dst->MarkDirty( a_X, a_Y, a_X + srcwidth - 1, a_Y + srcheight - 1 );
 			dst += a_X + dstpitch * a_Y;
 			for ( int y = 0; y < srcheight; y++ )
 			{
@@ -343,6 +452,7 @@ void Surface::InitCharset()
 
 void Surface::ScaleColor( unsigned int a_Scale )
 {
+	MarkAllDirty();
 	int s = m_Pitch * m_Height;
 	for ( int i = 0; i < s; i++ )
 	{
@@ -353,6 +463,89 @@ void Surface::ScaleColor( unsigned int a_Scale )
 	}
 }
 
+// sprite row blitters: draw a_Count pixels of a sprite row, skipping pixels
+// whose color is black (alpha is ignored). FLARE rows add with saturation like
+// AddBlend, which leaves alpha 0; other rows copy. The SIMD versions do 4 or 8
+// pixels at a time and are picked once, by SelectSpriteRows.
+typedef void (*SpriteRow)( const Pixel* a_Src, Pixel* a_Dst, int a_Count );
+
+static void FlareRow( const Pixel* a_Src, Pixel* a_Dst, int a_Count )
+{
+	for ( int x = 0; x < a_Count; x++ ) if (a_Src[x] & 0xffffff) a_Dst[x] = AddBlend( a_Src[x], a_Dst[x] );
+}
+
+static void OpaqueRow( const Pixel* a_Src, Pixel* a_Dst, int a_Count )
+{
+	for ( int x = 0; x < a_Count; x++ ) if (a_Src[x] & 0xffffff) a_Dst[x] = a_Src[x];
+}
+
+static void FlareRowSSE( const Pixel* a_Src, Pixel* a_Dst, int a_Count )
+{
+	const __m128i rgb = _mm_set1_epi32( 0xffffff ), zero = _mm_setzero_si128();
+	int x = 0;
+	for ( ; x + 4 <= a_Count; x += 4 )
+	{
+		const __m128i s = _mm_loadu_si128( (const __m128i*)(a_Src + x) ), d = _mm_loadu_si128( (const __m128i*)(a_Dst + x) );
+		const __m128i black = _mm_cmpeq_epi32( _mm_and_si128( s, rgb ), zero );
+		const __m128i sum = _mm_and_si128( _mm_adds_epu8( s, d ), rgb );
+		_mm_storeu_si128( (__m128i*)(a_Dst + x), _mm_or_si128( _mm_and_si128( black, d ), _mm_andnot_si128( black, sum ) ) );
+	}
+	FlareRow( a_Src + x, a_Dst + x, a_Count - x );
+}
+
+static void OpaqueRowSSE( const Pixel* a_Src, Pixel* a_Dst, int a_Count )
+{
+	const __m128i rgb = _mm_set1_epi32( 0xffffff ), zero = _mm_setzero_si128();
+	int x = 0;
+	for ( ; x + 4 <= a_Count; x += 4 )
+	{
+		const __m128i s = _mm_loadu_si128( (const __m128i*)(a_Src + x) ), d = _mm_loadu_si128( (const __m128i*)(a_Dst + x) );
+		const __m128i black = _mm_cmpeq_epi32( _mm_and_si128( s, rgb ), zero );
+		_mm_storeu_si128( (__m128i*)(a_Dst + x), _mm_or_si128( _mm_and_si128( black, d ), _mm_andnot_si128( black, s ) ) );
+	}
+	OpaqueRow( a_Src + x, a_Dst + x, a_Count - x );
+}
+
+// AVX2: masked loads and stores handle the row's tail, and black pixels are
+// simply not stored
+TARGET_AVX2 static void FlareRowAVX2( const Pixel* a_Src, Pixel* a_Dst, int a_Count )
+{
+	const __m256i rgb = _mm256_set1_epi32( 0xffffff ), zero = _mm256_setzero_si256();
+	const __m256i lane = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+	for ( int x = 0; x < a_Count; x += 8 )
+	{
+		const __m256i valid = _mm256_cmpgt_epi32( _mm256_set1_epi32( a_Count - x ), lane );
+		const __m256i s = _mm256_maskload_epi32( (const int*)(a_Src + x), valid ), d = _mm256_maskload_epi32( (const int*)(a_Dst + x), valid );
+		const __m256i visible = _mm256_andnot_si256( _mm256_cmpeq_epi32( _mm256_and_si256( s, rgb ), zero ), valid );
+		_mm256_maskstore_epi32( (int*)(a_Dst + x), visible, _mm256_and_si256( _mm256_adds_epu8( s, d ), rgb ) );
+	}
+}
+
+TARGET_AVX2 static void OpaqueRowAVX2( const Pixel* a_Src, Pixel* a_Dst, int a_Count )
+{
+	const __m256i rgb = _mm256_set1_epi32( 0xffffff ), zero = _mm256_setzero_si256();
+	const __m256i lane = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+	for ( int x = 0; x < a_Count; x += 8 )
+	{
+		const __m256i valid = _mm256_cmpgt_epi32( _mm256_set1_epi32( a_Count - x ), lane );
+		const __m256i s = _mm256_maskload_epi32( (const int*)(a_Src + x), valid );
+		const __m256i visible = _mm256_andnot_si256( _mm256_cmpeq_epi32( _mm256_and_si256( s, rgb ), zero ), valid );
+		_mm256_maskstore_epi32( (int*)(a_Dst + x), visible, s );
+	}
+}
+
+static SpriteRow flareRow = 0, opaqueRow = 0;
+
+// SelectSpriteRows - widest row blitters the CPU supports
+static void SelectSpriteRows()
+{
+	if (flareRow) return;
+	const unsigned int cpu = CpuFeatures();
+	if (cpu & CPU_AVX2) flareRow = FlareRowAVX2, opaqueRow = OpaqueRowAVX2;
+	else if (cpu & CPU_SSE2) flareRow = FlareRowSSE, opaqueRow = OpaqueRowSSE;
+	else flareRow = FlareRow, opaqueRow = OpaqueRow;
+}
+
 Sprite::Sprite( Surface* a_Surface, unsigned int a_NumFrames ) :
 	m_Width(  a_Surface->GetWidth() / a_NumFrames ),
 	m_Height( a_Surface->GetHeight() ),
@@ -360,10 +553,11 @@ Sprite::Sprite( Surface* a_Surface, unsigned int a_NumFrames ) :
 	m_NumFrames( a_NumFrames ),
 	m_CurrentFrame( 0 ),
 	m_Flags( 0 ),
-	m_Start( new unsigned int*[a_NumFrames] ),
+	m_Span( new Span*[a_NumFrames] ),
 	m_Surface( a_Surface )
 {
-	InitializeStartData();
+	InitializeSpans();
+	SelectSpriteRows();
 }
 
 Sprite::Sprite( Surface* a_Surface, unsigned int a_NumFrames, unsigned int a_Flags ) :
@@ -373,75 +567,132 @@ Sprite::Sprite( Surface* a_Surface, unsigned int a_NumFrames, unsigned int a_Fla
 	m_NumFrames( a_NumFrames ),
 	m_CurrentFrame( 0 ),
 	m_Flags( 0 ),
-	m_Start( new unsigned int*[a_NumFrames] ),
+	m_Span( new Span*[a_NumFrames] ),
 	m_Surface( a_Surface )
 {
-	InitializeStartData();
+	InitializeSpans();
+	SelectSpriteRows();
 	SetFlags( a_Flags );
 }
 
 Sprite::~Sprite()
 {
 	delete m_Surface;
-	for ( unsigned int i = 0; i < m_NumFrames; i++ ) delete m_Start[i];
-	delete m_Start;
+	for ( unsigned int i = 0; i < m_NumFrames; i++ ) delete[] m_Span[i];
+	delete[] m_Span;
 }
 
+// Sprite::Draw - draw the current frame, clipped to the target
 void Sprite::Draw( int a_X, int a_Y, Surface* a_Target )
 {
-	if ((a_X < -m_Width) || (a_X > (a_Target->GetWidth() + m_Width))) return;
-	if ((a_Y < -m_Height) || (a_Y > (a_Target->GetHeight() + m_Height))) return;
-	int x1 = a_X, x2 = a_X + m_Width;
-	int y1 = a_Y, y2 = a_Y + m_Height;
-	Pixel* src = GetBuffer() + m_CurrentFrame * m_Width;
-	if (x1 < 0)
+	a_Target->MarkDirty( a_X, a_Y, a_X + m_Width - 1, a_Y + m_Height - 1 );
+	DrawClipped( a_Target, a_X, a_Y, m_CurrentFrame, 0, 0, a_Target->GetWidth(), a_Target->GetHeight() );
+}
+
+// Sprite::DrawClipped - draw a frame clipped to the rectangle a_X1..a_X2 by
+// a_Y1..a_Y2 (exclusive) of the target: blit the visible span of each row
+void Sprite::DrawClipped( Surface* a_Target, int a_X, int a_Y, unsigned int a_Frame, int a_X1, int a_Y1, int a_X2, int a_Y2 )
+{
+	const int x1 = max( a_X, a_X1 ), x2 = min( a_X + m_Width, a_X2 );
+	const int y1 = max( a_Y, a_Y1 ), y2 = min( a_Y + m_Height, a_Y2 );
+	if ((x2 <= x1) || (y2 <= y1)) return;
+	const SpriteRow row = (m_Flags & FLARE) ? flareRow : opaqueRow;
+	const int dpitch = a_Target->GetPitch();
+	const Span* span = m_Span[a_Frame] + (y1 - a_Y);
+	const Pixel* src = GetBuffer() + a_Frame * m_Width + (y1 - a_Y) * m_Pitch;
+	Pixel* dest = a_Target->GetBuffer() + y1 * dpitch;
+	for ( int y = y1; y < y2; y++, span++, src += m_Pitch, dest += dpitch )
+	{
+		const int xs = max( x1, a_X + span->start ), xe = min( x2, a_X + span->end );
+		if (xs < xe) row( src + (xs - a_X), dest + xs, xe - xs );
+	}
+}
+
+// one row of screen tiles of a SpriteBatch per job
+class SpriteTileJob : public Job
+{
+public:
+	void Main() { for ( int row = first; row < last; row++ ) batch->DrawTileRow( row ); }
+	SpriteBatch* batch;
+	int first, last;
+};
+static SpriteTileJob tileJob[MAXJOBS];
+
+// SpriteBatch::Begin - start collecting instances for a_Target
+void SpriteBatch::Begin( Surface* a_Target )
+{
+	m_Target = a_Target;
+	m_TilesX = (a_Target->GetWidth() + BATCHTILE - 1) / BATCHTILE;
+	m_TilesY = (a_Target->GetHeight() + BATCHTILE - 1) / BATCHTILE;
+	m_Instance.clear();
+}
+
+// SpriteBatch::Add - queue a sprite frame at (a_X, a_Y); instances entirely
+// off the target are dropped here
+void SpriteBatch::Add( Sprite* a_Sprite, unsigned int a_Frame, int a_X, int a_Y )
+{
+	if ((a_X >= m_Target->GetWidth()) || (a_Y >= m_Target->GetHeight())) return;
+	if ((a_X + a_Sprite->GetWidth() <= 0) || (a_Y + a_Sprite->GetHeight() <= 0)) return;
+	Instance instance = { a_Sprite, a_Frame, a_X, a_Y };
+	m_Instance.push_back( instance );
+	m_Target->MarkDirty( a_X, a_Y, a_X + a_Sprite->GetWidth() - 1, a_Y + a_Sprite->GetHeight() - 1 ); // here, not in the tile jobs
+}
+
+// SpriteBatch::Draw - bin the instances by tile with a counting sort that keeps
+// their order, then draw the tiles; the batch is empty afterwards
+void SpriteBatch::Draw( bool a_Parallel )
+{
+	const int tiles = m_TilesX * m_TilesY, w = m_Target->GetWidth(), h = m_Target->GetHeight();
+	m_TileStart.assign( tiles + 1, 0 );
+	for ( int pass = 0; pass < 2; pass++ )
 	{
-		src += -x1;
-		x1 = 0;
+		for ( unsigned int i = 0; i < m_Instance.size(); i++ )
+		{
+			const Instance& n = m_Instance[i];
+			const int tx0 = max( n.x, 0 ) / BATCHTILE, tx1 = (min( n.x + n.sprite->GetWidth(), w ) - 1) / BATCHTILE;
+			const int ty0 = max( n.y, 0 ) / BATCHTILE, ty1 = (min( n.y + n.sprite->GetHeight(), h ) - 1) / BATCHTILE;
+			for ( int ty = ty0; ty <= ty1; ty++ ) for ( int tx = tx0; tx <= tx1; tx++ )
+				if (pass == 0) m_TileStart[ty * m_TilesX + tx + 1]++;
+				else m_TileIndex[m_TileStart[ty * m_TilesX + tx]++] = i;
+		}
+		if (pass == 0)
+		{
+			// exclusive prefix sum: each tile's first slot, used as its write cursor
+			for ( int t = 0; t < tiles; t++ ) m_TileStart[t + 1] += m_TileStart[t];
+			m_TileIndex.resize( m_TileStart[tiles] );
+		}
 	}
-	if (x2 > a_Target->GetWidth()) x2 = a_Target->GetWidth();
-	if (y1 < 0) 
-	{ 
-		src += -y1 * m_Pitch;
-		y1 = 0;
+	// the cursors ended at the start of the next tile; shift them back
+	for ( int t = tiles; t > 0; t-- ) m_TileStart[t] = m_TileStart[t - 1];
+	m_TileStart[0] = 0;
+	JobManager* jm = JobManager::GetJobManager();
+	if (a_Parallel && jm && (jm->GetNumThreads() > 1))
+	{
+		const int perJob = (m_TilesY + MAXJOBS - 1) / MAXJOBS;
+		for ( int j = 0; j * perJob < m_TilesY; j++ )
+		{
+			tileJob[j].batch = this, tileJob[j].first = j * perJob, tileJob[j].last = min( (j + 1) * perJob, m_TilesY );
+			jm->AddJob2( &tileJob[j] );
+		}
+		jm->RunJobs();
 	}
-	if (y2 > a_Target->GetHeight()) y2 = a_Target->GetHeight();
-	Pixel* dest = a_Target->GetBuffer();
-	int xs;
-	const int dpitch = a_Target->GetPitch();
-	if ((x2 > x1) && (y2 > y1))
+	else for ( int row = 0; row < m_TilesY; row++ ) DrawTileRow( row );
+	m_Instance.clear();
+}
+
+// SpriteBatch::DrawTileRow - draw the instances of one row of tiles; tiles do
+// not overlap, so rows can be drawn concurrently
+void SpriteBatch::DrawTileRow( int a_Row )
+{
+	const int y1 = a_Row * BATCHTILE, y2 = min( y1 + BATCHTILE, m_Target->GetHeight() );
+	for ( int tx = 0; tx < m_TilesX; tx++ )
 	{
-		unsigned int addr = y1 * dpitch + x1;
-		const int width = x2 - x1;
-		const int height = y2 - y1;
-		for ( int y = 0; y < height; y++ )
+		const int t = a_Row * m_TilesX + tx;
+		const int x1 = tx * BATCHTILE, x2 = min( x1 + BATCHTILE, m_Target->GetWidth() );
+		for ( unsigned int k = m_TileStart[t]; k < m_TileStart[t + 1]; k++ )
 		{
-			const int line = y + (y1 - a_Y);
-			const int lsx = m_Start[m_CurrentFrame][line] + a_X;
-			if (m_Flags & FLARE)
-			{
-				xs = (lsx > x1)?lsx - x1:0;
-				for ( int x = xs; x < width; x++ )
-				{
-					const Pixel c1 = *(src + x);
-					if (c1 & 0xffffff) 
-					{
-						const Pixel c2 = *(dest + addr + x);
-						*(dest + addr + x) = AddBlend( c1, c2 );
-					}
-				}
-			}
-			else 
-			{
-				xs = (lsx > x1)?lsx - x1:0;
-				for ( int x = xs; x < width; x++ )
-				{
-					const Pixel c1 = *(src + x);
-					if (c1 & 0xffffff) *(dest + addr + x) = c1;
-				}
-			}
-			addr += dpitch;
-			src += m_Pitch;
+			const Instance& n = m_Instance[m_TileIndex[k]];
+			n.sprite->DrawClipped( m_Target, n.x, n.y, n.frame, x1, y1, x2, y2 );
 		}
 	}
 }
@@ -452,6 +703,7 @@ void Sprite::DrawScaled( int a_X, int a_Y, int a_Width, int a_Height, Surface* a
 	int v = 0;
 	int du = (m_Pitch << 10) / a_Width;
 	int dv = (m_Height << 10) / a_Height;
+	a_Target->MarkDirty( a_X, a_Y, a_X + a_Width - 1, a_Y + a_Height - 1 );
 	Pixel* dest = a_Target->GetBuffer() + a_X + a_Y * a_Target->GetPitch();
 	Pixel* src = GetBuffer() + m_CurrentFrame * m_Pitch;
 	int x, y;
@@ -469,23 +721,19 @@ void Sprite::DrawScaled( int a_X, int a_Y, int a_Width, int a_Height, Surface* a
 	}
 }
 
-void Sprite::InitializeStartData()
-{
-    for ( unsigned int f = 0; f < m_NumFrames; ++f )
-    {
-        m_Start[f] = new unsigned int[m_Height];
-     	for ( int y = 0; y < m_Height; ++y )
-     	{
-      	    m_Start[f][y] = m_Width;
-			Pixel* addr = GetBuffer() + f * m_Width + y * m_Pitch;
-     	    for ( int x = 0; x < m_Width; ++x )
-     	    {
-                if (addr[x])
-     	        {
-     	            m_Start[f][y] = x;
-                    break;
-                }
-            }
+// Sprite::InitializeSpans - find the non-black pixels of every row of every frame
+void Sprite::InitializeSpans()
+{
+	for ( unsigned int f = 0; f < m_NumFrames; ++f )
+	{
+		m_Span[f] = new Span[m_Height];
+		for ( int y = 0; y < m_Height; ++y )
+		{
+			const Pixel* addr = GetBuffer() + f * m_Width + y * m_Pitch;
+			int start = 0, end = m_Width;
+			while ((start < end) && !(addr[start] & 0xffffff)) start++;
+			while ((end > start) && !(addr[end - 1] & 0xffffff)) end--;
+			m_Span[f][y].start = start, m_Span[f][y].end = end;
 		}
 	}
 }
@@ -558,6 +806,7 @@ void Font::Print( Surface* a_Target, char* a_Text, int a_X, int a_Y, bool clip )
 	unsigned int i, cx;
 	int x, y;
 	if (((a_Y + m_Height) < m_CY1) || (a_Y > m_CY2)) return;
+	a_Target->MarkDirty( a_X, a_Y, a_X + Width( a_Text ), a_Y + m_Height - 1 );
 	for ( cx = 0, i = 0; i < strlen( a_Text ); i++ )
 	{
 		if (a_Text[i] == ' ') cx += 4; else
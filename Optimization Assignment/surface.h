@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <vector>
+
 namespace Tmpl8 {
 
 #include "emmintrin.h"
@@ -11,7 +13,9 @@ namespace Tmpl8 {
 #define GREENMASK (0x00ff00)
 #define BLUEMASK (0x0000ff)
 
-typedef unsigned long Pixel;
+typedef unsigned int Pixel;
+
+#define DIRTYTILE	16		// pixels per side of a dirty tile
 
 inline Pixel AddBlend( Pixel a_Color1, Pixel a_Color2 )
 {
@@ -74,6 +78,9 @@ public:
 	};
 };
 
+// DecodeImage - decode a TGA or PNG file held in memory, see image.cpp
+Pixel* DecodeImage( const unsigned char* a_Data, size_t a_Size, int& a_Width, int& a_Height );
+
 class Surface
 {
 	enum
@@ -108,16 +115,28 @@ public:
 	void AddPlot( int x, int y, Pixel c );
 	void MultiAddPlot(int x, int y, Pixel c, int count);
 	void LoadImage( char* a_File );
+	static Surface* Asset( char* a_File );	// decoded once and shared, owned by the cache
 	void CopyTo( Surface* a_Dst, int a_X, int a_Y );
 	void BlendCopyTo( Surface* a_Dst, int a_X, int a_Y );
 	void ScaleColor( unsigned int a_Scale );
 	void Box( int x1, int y1, int x2, int y2, Pixel color );
 	void Bar( int x1, int y1, int x2, int y2, Pixel color );
 	void Resize( Surface* a_Orig );
+	// dirty tracking: once enabled, every drawing operation marks the
+	// DIRTYTILE tiles it wrote to, and Restore copies only those back from a
+	// backdrop. Code writing to GetBuffer() directly marks its own writes.
+	void TrackDirty();
+	void MarkDirty( int x1, int y1, int x2, int y2 );	// inclusive bounds, clipped
+	void MarkAllDirty() { MarkDirty( 0, 0, m_Width - 1, m_Height - 1 ); }
+	typedef void (*RestoreSpan)( void* a_Context, Pixel* a_Dst, int a_X, int a_Y, int a_Width );
+	void Restore( Surface* a_Backdrop );
+	void Restore( RestoreSpan a_Span, void* a_Context );	// a_Span refills each dirty span
 private:
 	// Attributes
 	Pixel* m_Buffer;	
 	int m_Width, m_Height, m_Pitch;	
+	unsigned char* m_Dirty;			// one byte per tile, 0 if not tracking
+	int m_DirtyX, m_DirtyY, m_DirtyCount;	// tiles per row and column, tiles marked
 	// Static attributes for the buildin font
 	char s_Font[51][5][5];	
 	int s_Transl[256];		
@@ -147,6 +166,7 @@ public:
 	~Sprite();
 	// Methods
 	void Draw( int a_X, int a_Y, Surface* a_Target = 0 );
+	void DrawClipped( Surface* a_Target, int a_X, int a_Y, unsigned int a_Frame, int a_X1, int a_Y1, int a_X2, int a_Y2 );
 	void DrawScaled( int a_X, int a_Y, int a_Width, int a_Height, Surface* a_Target );
 	void SetFlags( unsigned int a_Flags ) { m_Flags = a_Flags; }
 	void SetFrame( unsigned int a_Index ) { m_CurrentFrame = a_Index; }
@@ -157,17 +177,42 @@ public:
 	unsigned int Frames() { return m_NumFrames; }
 	Surface* GetSurface() { return m_Surface; }
 private:
+	// first and one past the last non-black pixel of a row; empty rows have start == end
+	struct Span { int start, end; };
 	// Methods
-	void InitializeStartData();
+	void InitializeSpans();
 	// Attributes
 	int m_Width, m_Height, m_Pitch;
 	unsigned int m_NumFrames;          
 	unsigned int m_CurrentFrame;       
 	unsigned int m_Flags;
-	unsigned int** m_Start;
+	Span** m_Span;				// per frame, per row
 	Surface* m_Surface;
 };
 
+// SpriteBatch - collects sprite instances and draws them screen tile by screen
+// tile: Draw bins the instances into the tiles they overlap and rasterises each
+// tile clipped to its rectangle, optionally on the job threads. A tile draws
+// its instances in the order they were added, so the result is the same as
+// drawing them one by one.
+#define BATCHTILE	64		// tile size in pixels
+class SpriteBatch
+{
+public:
+	SpriteBatch() : m_Target( 0 ), m_TilesX( 0 ), m_TilesY( 0 ) {}
+	void Begin( Surface* a_Target );
+	void Add( Sprite* a_Sprite, unsigned int a_Frame, int a_X, int a_Y );
+	void Draw( bool a_Parallel = true );
+	void DrawTileRow( int a_Row );
+private:
+	struct Instance { Sprite* sprite; unsigned int frame; int x, y; };
+	Surface* m_Target;
+	int m_TilesX, m_TilesY;
+	std::vector<Instance> m_Instance;
+	std::vector<unsigned int> m_TileStart;	// tile t draws m_TileIndex[m_TileStart[t]] up to m_TileStart[t + 1]
+	std::vector<unsigned int> m_TileIndex;	// instance indices, grouped by tile
+};
+
 class Font
 {
 public:
@@ -11,6 +11,11 @@
 #pragma warning (disable : 4311) // pointer truncation from HANDLE to long
 
 #include "template.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
 
 namespace Tmpl8 { 
 
@@ -25,12 +30,98 @@ float2 operator * ( float2& v, float& s ) { return float2( v.x * s, v.y * s ); }
 
 void NotifyUser( char* s )
 {
+#ifdef _WIN32
 	HWND hApp = FindWindow( NULL, "Template" );
 	MessageBox( hApp, s, "ERROR", MB_OK );
+#else
+	fprintf( stderr, "ERROR: %s\n", s );
+#endif
 	exit( 0 );
 }
 }
 
+double Timer::inv_freq = 1;
+
+#ifdef _WIN32
+MappedFile::MappedFile( const char* a_File ) : m_Data( 0 ), m_Size( 0 ), m_Mapping( 0 )
+{
+	m_File = CreateFileA( a_File, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+	if (m_File == INVALID_HANDLE_VALUE) return;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx( m_File, &size ) || !size.QuadPart) return;
+	m_Mapping = CreateFileMapping( m_File, 0, PAGE_READONLY, 0, 0, 0 );
+	if (!m_Mapping) return;
+	m_Data = (const unsigned char*)MapViewOfFile( m_Mapping, FILE_MAP_READ, 0, 0, 0 );
+	if (m_Data) m_Size = (size_t)size.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_Data) UnmapViewOfFile( m_Data );
+	if (m_Mapping) CloseHandle( m_Mapping );
+	if (m_File != INVALID_HANDLE_VALUE) CloseHandle( m_File );
+}
+#else
+MappedFile::MappedFile( const char* a_File ) : m_Data( 0 ), m_Size( 0 )
+{
+	const int file = open( a_File, O_RDONLY );
+	if (file < 0) return;
+	struct stat info;
+	if (!fstat( file, &info ) && (info.st_size > 0))
+	{
+		void* data = mmap( 0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+		if (data != MAP_FAILED) m_Data = (const unsigned char*)data, m_Size = (size_t)info.st_size;
+	}
+	close( file );
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_Data) munmap( (void*)m_Data, m_Size );
+}
+#endif
+
+// CpuId, XGetBV - cpuid (subleaf 0) and xgetbv( 0 ) for MSVC and GCC
+static void CpuId( int* a_Info, int a_Leaf )
+{
+#ifdef _WIN32
+	__cpuidex( a_Info, a_Leaf, 0 );
+#else
+	__cpuid_count( a_Leaf, 0, a_Info[0], a_Info[1], a_Info[2], a_Info[3] );
+#endif
+}
+
+static unsigned long long XGetBV()
+{
+#ifdef _WIN32
+	return _xgetbv( 0 );
+#else
+	unsigned int lo, hi;
+	__asm__ volatile ( "xgetbv" : "=a" (lo), "=d" (hi) : "c" (0) );
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+// CpuFeatures - CPU_SSE2 and CPU_AVX2 if both the CPU and the OS support them
+unsigned int Tmpl8::CpuFeatures()
+{
+	static int features = -1;
+	if (features >= 0) return features;
+	int info[4];
+	CpuId( info, 0 );
+	const int maxLeaf = info[0];
+	CpuId( info, 1 );
+	features = (info[3] & (1 << 26)) ? CPU_SSE2 : 0;
+	const bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((XGetBV() & 6) == 6); // OSXSAVE, AVX, ymm state
+	if (avx && (maxLeaf >= 7))
+	{
+		CpuId( info, 7 );
+		if (info[1] & (1 << 5)) features |= CPU_AVX2;
+	}
+	return features;
+}
+
+#ifdef _WIN32
 static int SCRPITCH = 0;
 int ACTWIDTH, ACTHEIGHT;
 static bool FULLSCREEN = false, firstframe = true;
@@ -39,7 +130,6 @@ Surface* surface = 0;
 Game* game = 0;
 float lastftime = 0;
 LARGE_INTEGER lasttime, ticksPS;
-double Timer::inv_freq = 1;
 
 float GetTime()
 {
@@ -102,48 +192,75 @@ void redirectIO()
 
 int main( int argc, char **argv ) 
 {  
+	for ( int i = 1; i < argc; i++ ) if (!strcmp( argv[i], "-bench" ))
+	{
+		// headless run: report to the console that started us, if any
+		if (!AttachConsole( ATTACH_PARENT_PROCESS )) AllocConsole();
+		freopen( "CONOUT$", "w", stdout );
+		freopen( "CONOUT$", "w", stderr );
+		return Benchmark( argc, argv );
+	}
 	redirectIO();
 	printf( "application started.\n" );
 	SDL_Init( SDL_INIT_VIDEO );
 	surface = new Surface( SCRWIDTH, SCRHEIGHT );
 	surface->Clear( 0 );
 	surface->InitCharset();
+	game = new Game();
+	game->SetTarget( surface );
+	game->m_Config.Parse( argc, argv );
+	// the simulation keeps its own tick rate, vsync only paces the drawing; uncapped, it would hold back the ticking
+	const Uint32 vsync = game->m_Config.uncapped ? 0 : SDL_RENDERER_PRESENTVSYNC;
 	SDL_Window* window = SDL_CreateWindow( "Template", 100, 100, SCRWIDTH, SCRHEIGHT, SDL_WINDOW_SHOWN );
-	SDL_Renderer* renderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
+	SDL_Renderer* renderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | vsync );
 	SDL_Texture* frameBuffer = SDL_CreateTexture( renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCRWIDTH, SCRHEIGHT );
 	int exitapp = 0;
-	game = new Game();
-	game->SetTarget( surface );
+	for ( int i = 1; i < argc - 1; i++ )
+	{
+		// -record <file>: log the mouse input per tick; -replay <file>: play such a log back
+		if (!strcmp( argv[i], "-record" )) game->m_Input.Record( argv[i + 1] );
+		if (!strcmp( argv[i], "-replay" )) game->m_Input.Replay( argv[i + 1] );
+	}
 	while (!exitapp) 
 	{
-		void* target = 0;
-		int pitch;
-		SDL_LockTexture( frameBuffer, NULL, &target, &pitch );
-		if (pitch == (surface->GetWidth() * 4))
 		{
-			memcpy( target, surface->GetBuffer(), SCRWIDTH * SCRHEIGHT * 4 );
-		}
-		else
-		{
-			unsigned char* t = (unsigned char*)target;
-			for( int i = 0; i < SCRHEIGHT; i++ )
+			PROFILE( ZONE_PRESENT );
+			void* target = 0;
+			int pitch;
+			SDL_LockTexture( frameBuffer, NULL, &target, &pitch );
+			if (pitch == (surface->GetWidth() * 4))
+			{
+				memcpy( target, surface->GetBuffer(), SCRWIDTH * SCRHEIGHT * 4 );
+			}
+			else
 			{
-				memcpy( t, surface->GetBuffer() + i * SCRWIDTH, SCRWIDTH * 4 );
-				t += pitch;
+				unsigned char* t = (unsigned char*)target;
+				for( int i = 0; i < SCRHEIGHT; i++ )
+				{
+					memcpy( t, surface->GetBuffer() + i * SCRWIDTH, SCRWIDTH * 4 );
+					t += pitch;
+				}
 			}
+			SDL_UnlockTexture( frameBuffer );
+			SDL_RenderCopy( renderer, frameBuffer, NULL, NULL );
+			SDL_RenderPresent( renderer );
 		}
-		SDL_UnlockTexture( frameBuffer );
-		SDL_RenderCopy( renderer, frameBuffer, NULL, NULL );
-		SDL_RenderPresent( renderer );
 		if (firstframe)
 		{
 			game->Init(false);
 			firstframe = false;
+			StartTimer();
 		}
-		// calculate frame time and pass it to game->Tick
-		StartTimer();
-		game->Tick( lastftime );
+		// poll the mouse; the events below miss a button released outside the window
+		POINT p;
+		GetCursorPos( &p );
+		ScreenToClient( FindWindow( NULL, "Template" ), &p );
+		game->MouseMove( p.x, p.y );
+		game->MouseButton( GetAsyncKeyState( VK_LBUTTON ) != 0 );
+		// frame time, present included: game->Frame turns it into fixed ticks
 		lastftime = GetDuration();
+		StartTimer();
+		game->Frame( lastftime );
 		// event loop
 		SDL_Event event;
 		while (SDL_PollEvent( &event )) 
@@ -178,6 +295,14 @@ int main( int argc, char **argv )
 			}
 		}
 	}
+	game->m_Input.Stop();
 	SDL_Quit();
 	return 1;
-}
\ No newline at end of file
+}
+#else
+// without a window the executable is the headless benchmark (see benchmark.cpp)
+int main( int argc, char **argv ) 
+{  
+	return Benchmark( argc, argv );
+}
+#endif
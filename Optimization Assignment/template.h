@@ -6,8 +6,21 @@
 #include "math.h"
 #include "stdlib.h"
 #include "emmintrin.h"
+#include "immintrin.h"
 #include "stdio.h"
+#ifdef _WIN32
+#include "intrin.h"
 #include "windows.h"
+#define ALIGN(x)			__declspec(align(x))
+#define TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#define ALIGN(x)			__attribute__((aligned(x)))
+#define TARGET_AVX2			__attribute__((target("avx2")))	// no fma: contracted mul/add would round differently
+#endif
 #include "surface.h"
 
 namespace Tmpl8 {
@@ -80,25 +93,33 @@ float length( const float2& v );
 
 };
 
-#include "game.h"
 #include <vector>
-#include "freeimage.h"
+#include "game.h"
 #include "threads.h"
-
+#include <ios>
+#include <iostream>
+#include <fstream>
+#include <stdio.h>
+#ifdef _WIN32
+#ifndef NOFREEIMAGE
+#include "freeimage.h"
+#endif
 extern "C" 
 { 
 #include "glew.h" 
 }
 #include "gl.h"
 #include "io.h"
-#include <ios>
-#include <iostream>
-#include <fstream>
-#include <stdio.h>
 #include "SDL.h"
 #include "SDL_syswm.h"
 #include "wglext.h"
 #include "fcntl.h"
+#else
+#ifndef NOFREEIMAGE
+#include "FreeImage.h"
+#endif
+#include <algorithm>
+#endif
 
 using namespace Tmpl8;				// to use template classes
 using namespace std;				// to use stl vectors
@@ -106,14 +127,20 @@ using namespace std;				// to use stl vectors
 inline float Rand( float range ) { return ((float)rand() / RAND_MAX) * range; }
 inline int IRand( int range ) { return rand() % range; }
 int filesize( FILE* f );
+int Benchmark( int argc, char** argv );
 
 namespace Tmpl8 {
 
 #define PI					3.14159265358979323846264338327950f
 #define INVPI				0.31830988618379067153776752674503f
 
+#ifdef _WIN32
 #define MALLOC64(x)			_aligned_malloc(x,64)
 #define FREE64(x)			_aligned_free(x)
+#else
+inline void* MALLOC64( size_t s ) { void* p = 0; return posix_memalign( &p, 64, s ? s : 64 ) ? 0 : p; }
+#define FREE64(x)			free(x)
+#endif
 #define PREFETCH(x)			_mm_prefetch((const char*)(x),_MM_HINT_T0)
 #define PREFETCH_ONCE(x)	_mm_prefetch((const char*)(x),_MM_HINT_NTA)
 #define PREFETCH_WRITE(x)	_m_prefetchw((const char*)(x))
@@ -128,26 +155,60 @@ struct Timer
 	value_type start; 
 	Timer() : start( get() ) { init(); } 
 	float elapsed() const { return (float)((get() - start) * inv_freq); } 
+#ifdef _WIN32
 	static value_type get() 
 	{ 
 		LARGE_INTEGER c; 
 		QueryPerformanceCounter( &c ); 
 		return c.QuadPart; 
 	} 
+#else
+	static value_type get() 
+	{ 
+		timespec t; 
+		clock_gettime( CLOCK_MONOTONIC, &t ); 
+		return (value_type)t.tv_sec * 1000000000 + t.tv_nsec; 
+	} 
+#endif
 	static double to_time(const value_type vt) { return double(vt) * inv_freq; } 
 	void reset() { start = get(); }
+#ifdef _WIN32
 	static void init() 
 	{ 
 		LARGE_INTEGER f; 
 		QueryPerformanceFrequency( &f ); 
 		inv_freq = 1000./double(f.QuadPart); 
 	} 
+#else
+	static void init() { inv_freq = 1e-6; } 
+#endif
 }; 
 
+// read-only mapping of a whole file; GetData() is 0 if it could not be mapped
+class MappedFile
+{
+public:
+	MappedFile( const char* a_File );
+	~MappedFile();
+	const unsigned char* GetData() const { return m_Data; }
+	size_t GetSize() const { return m_Size; }
+private:
+	const unsigned char* m_Data;
+	size_t m_Size;
+#ifdef _WIN32
+	HANDLE m_File, m_Mapping;
+#endif
+};
+
+// instruction sets the SIMD paths can pick from at runtime
+enum { CPU_SSE2 = 1, CPU_AVX2 = 2 };
+unsigned int CpuFeatures();
+
 typedef unsigned int uint;
 typedef unsigned char uchar;
 typedef unsigned char byte;
 
 #define BADFLOAT(x) ((*(uint*)&x & 0x7f000000) == 0x7f000000)
 
-}; // namespace Tmpl8
\ No newline at end of file
+}; // namespace Tmpl8
+#include "profiler.h"
@@ -5,6 +5,7 @@
 
 using namespace Tmpl8;
 
+#ifdef _WIN32
 const int Thread::P_ABOVE_NORMAL = THREAD_PRIORITY_ABOVE_NORMAL;
 const int Thread::P_BELOW_NORMAL = THREAD_PRIORITY_BELOW_NORMAL;
 const int Thread::P_HIGHEST = THREAD_PRIORITY_HIGHEST;
@@ -60,6 +61,70 @@ void Thread::SetName( char* _Name )
 	if (::IsDebuggerPresent()) RaiseException( 0x406D1388, 0, sizeof( info ) / sizeof( ULONG_PTR ), (ULONG_PTR*)&info );
 }
 
+#else
+// POSIX versions of the Win32 calls made by the job system below
+typedef unsigned int DWORD;
+typedef void* LPVOID;
+typedef DWORD (*LPTHREAD_START_ROUTINE)( LPVOID );
+#define INFINITE	0xffffffff
+#define TRUE		1
+#define FALSE		0
+
+struct ThreadStart { LPTHREAD_START_ROUTINE proc; LPVOID param; };
+static void* ThreadEntry( void* a_Start )
+{
+	ThreadStart start = *(ThreadStart*)a_Start;
+	delete (ThreadStart*)a_Start;
+	start.proc( start.param );
+	return 0;
+}
+
+static HANDLE CreateThread( void*, size_t, LPTHREAD_START_ROUTINE a_Proc, LPVOID a_Param, DWORD, DWORD* )
+{
+	ThreadStart* start = new ThreadStart;
+	start->proc = a_Proc, start->param = a_Param;
+	pthread_t thread;
+	pthread_create( &thread, 0, ThreadEntry, start );
+	pthread_detach( thread );
+	return 0;
+}
+
+static HANDLE CreateEvent( void*, int, int, void* )
+{
+	JobEvent* e = new JobEvent;
+	pthread_mutex_init( &e->lock, 0 );
+	pthread_cond_init( &e->cond, 0 );
+	e->signaled = false;
+	return e;
+}
+
+static void SetEvent( HANDLE e )
+{
+	pthread_mutex_lock( &e->lock );
+	e->signaled = true;
+	pthread_cond_signal( &e->cond );
+	pthread_mutex_unlock( &e->lock );
+}
+
+static void WaitForSingleObject( HANDLE e, DWORD )
+{
+	pthread_mutex_lock( &e->lock );
+	while (!e->signaled) pthread_cond_wait( &e->cond, &e->lock );
+	e->signaled = false;
+	pthread_mutex_unlock( &e->lock );
+}
+
+static void WaitForMultipleObjects( DWORD n, HANDLE* e, int, DWORD )
+{
+	for ( DWORD i = 0; i < n; i++ ) WaitForSingleObject( e[i], INFINITE );
+}
+
+static void InitializeCriticalSection( CRITICAL_SECTION* cs ) { pthread_mutex_init( cs, 0 ); }
+static void DeleteCriticalSection( CRITICAL_SECTION* cs ) { pthread_mutex_destroy( cs ); }
+static void EnterCriticalSection( CRITICAL_SECTION* cs ) { pthread_mutex_lock( cs ); }
+static void LeaveCriticalSection( CRITICAL_SECTION* cs ) { pthread_mutex_unlock( cs ); }
+#endif
+
 DWORD JobThreadProc( LPVOID lpParameter )
 {
 	JobThread* JobThreadInstance = (JobThread*) lpParameter;
@@ -86,6 +151,7 @@ void JobThread::BackgroundTask()
 				JobManager::GetJobManager()->ThreadDone( m_ThreadID );
 				break;
 			}
+			PROFILE( ZONE_JOB );
 			job->RunCodeWrapper();
 		}
 	}
@@ -144,6 +210,7 @@ void JobManager::RunJobs()
 	{
 		m_JobThreadList[i].Go();
 	}
+	PROFILE( ZONE_JOBWAIT );
 	WaitForMultipleObjects( m_NumThreads, m_ThreadDone, TRUE, INFINITE );
 }
 
@@ -6,6 +6,7 @@
 #define MAXJOBTHREADS	32
 #define MAXJOBS			512
 
+#ifdef _WIN32
 class Thread 
 {
 public:
@@ -31,6 +32,14 @@ private:
 	static const int P_CRITICAL;
 };
 extern "C" { unsigned int sthread_proc( void* param ); }
+#else
+// POSIX stand-ins for the Win32 objects used by the job system: an auto-reset
+// event and a critical section; the calls on them are in threads.cpp
+#include <pthread.h>
+struct JobEvent { pthread_mutex_t lock; pthread_cond_t cond; bool signaled; };
+typedef JobEvent* HANDLE;
+typedef pthread_mutex_t CRITICAL_SECTION;
+#endif
 
 namespace Tmpl8 {
 